@@ -0,0 +1,319 @@
+#include <chrono>
+using namespace std::chrono_literals;
+using std::chrono::steady_clock;
+
+#include <cstring>
+#include <random>
+
+#include <string>
+using std::string;
+
+#include <iostream>
+using std::cout;
+using std::endl;
+
+#include <memory>
+using std::make_unique;
+using std::shared_ptr;
+
+#include <vector>
+using std::vector;
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <particulo/particulo.hpp>
+
+// Headless versions of the bundled examples, run for a fixed number of steps at several particle and thread counts.
+// Results are printed to stdout as JSON. Pass --quick for a short smoke run.
+
+static constexpr int MaxCount = 1 << 20;
+static constexpr int Width = 1000;
+static constexpr int Height = 1000;
+
+static std::mt19937 gen = std::mt19937(42);
+
+namespace BouncingBalls
+{
+struct Particle
+{
+   Particle(int index) : index(index) {}
+   Particle(int index, int width, int height) : index(index), pos(0, width, 0, height) {}
+   const int index;
+   v2d::v2d pos = v2d::v2d(0, 100, 0, 100);
+   v2d::v2d vel = v2d::v2d(0, 1, 0, 1);
+   v2d::v2d acc = v2d::v2d(0, 1, 0, 1);
+   uint32_t color = 0xbf44fcff;
+   float radius = 5.0f;
+};
+template <int threadCount>
+class Simulation : public Particulo::Particulo<Particle, threadCount>
+{
+public:
+   Simulation(int count) : count(count) {}
+   void init() override {
+      auto particles = this->DangerouslyGet();
+      for (int i = 0; i < count; i++) { particles.push_back(this->NewParticle(Width, Height)); }
+      this->DangerouslySet(std::move(particles));
+   }
+   void simulate(const vector<shared_ptr<Particle>>& /*snapshot*/, const span<shared_ptr<Particle>> section, milliseconds /*timeElapsed*/) override {
+      for (auto& p : section)
+      {
+         p->color = p->index % 2 == 0 ? 0xbf44fcff : 0x007ACCff;
+         p->vel += p->acc;
+         p->acc *= 0.1;
+         p->pos += p->vel;
+         if (p->pos.x > this->GetWidth() || p->pos.x < 0) { p->vel.x *= -1; }
+         if (p->pos.y > this->GetHeight() || p->pos.y < 0) { p->vel.y *= -1; }
+      }
+   }
+
+private:
+   int count;
+};
+} // namespace BouncingBalls
+
+namespace Verlet
+{
+struct Particle
+{
+   Particle(int index) : index(index) {}
+   Particle(int index, int width, int height) : index(index), pos(0, width, 0, height), prev_pos(pos) {}
+   const int index;
+   v2d::v2d pos = v2d::v2d(0, 100, 0, 100);
+   v2d::v2d prev_pos = pos;
+   v2d::v2d acc = v2d::v2d(0, 0.1, 0, 0.1);
+   uint32_t color = 0xbf44fcff;
+   float radius = 5.0f;
+};
+template <int threadCount>
+class Simulation : public Particulo::Particulo<Particle, threadCount>
+{
+public:
+   Simulation(int count) : count(count) {}
+   void init() override {
+      auto particles = this->DangerouslyGet();
+      for (int i = 0; i < count; i++) { particles.push_back(this->NewParticle(Width, Height)); }
+      this->DangerouslySet(std::move(particles));
+   }
+   void simulate(const vector<shared_ptr<Particle>>& /*snapshot*/, const span<shared_ptr<Particle>> section, milliseconds /*timeElapsed*/) override {
+      for (auto& p : section)
+      {
+         auto next = p->pos * 2.0f - p->prev_pos + p->acc;
+         p->prev_pos = p->pos;
+         p->pos = next;
+         if (p->pos.x > this->GetWidth() || p->pos.x < 0) { std::swap(p->pos.x, p->prev_pos.x); }
+         if (p->pos.y > this->GetHeight() || p->pos.y < 0) { std::swap(p->pos.y, p->prev_pos.y); }
+      }
+   }
+
+private:
+   int count;
+};
+} // namespace Verlet
+
+namespace SolarSystem
+{
+static float constexpr SizeRatio = 750000.0;
+static float constexpr GCONSTANT = 1.00E3;
+static float constexpr TIMESTEP = 0.0001;
+
+struct Particle
+{
+   Particle(int index) : index(index) {}
+   Particle(int index, int width, int height, float mass) : index(index), pos(0, width, 0, height), mass(mass), radius(mass / SizeRatio * 1.0f) {}
+
+   const int index;
+   v2d::v2d pos;
+   v2d::v2d vel;
+   v2d::v2d force;
+   uint32_t color = 0x00b894ff;
+   float mass;
+   float radius;
+};
+template <int threadCount>
+class Simulation : public Particulo::Particulo<Particle, threadCount>
+{
+public:
+   Simulation(int count) : count(count) {}
+   void init() override {
+      std::uniform_real_distribution<float> massDistr(0, SizeRatio);
+      auto particles = this->DangerouslyGet();
+      for (int i = 0; i < count; i++) { particles.push_back(this->NewParticle(Width, Height, massDistr(gen))); }
+      this->DangerouslySet(std::move(particles));
+   }
+   void simulate(const vector<shared_ptr<Particle>>& snapshot, const span<shared_ptr<Particle>> section, milliseconds /*timeElapsed*/) override {
+      for (auto& each : section)
+      {
+         for (auto& particle : snapshot)
+         {
+            float distance = sqrtf(each->pos.sqrDist(particle->pos));
+            if (distance > 4.0)
+            {
+               float pairForce = ((particle->mass * each->mass) / (GCONSTANT * (distance * distance)));
+               auto F = ((particle->pos - each->pos) / distance) * pairForce;
+               each->force += F;
+            }
+         }
+      }
+   }
+   void update(const vector<shared_ptr<Particle>>& particles, milliseconds /*timeElapsed*/) override {
+      for (auto& each : particles)
+      {
+         each->vel += each->force / each->mass;
+         each->pos += each->vel * TIMESTEP;
+         each->force = {0, 0};
+      }
+   }
+
+private:
+   int count;
+};
+} // namespace SolarSystem
+
+namespace Rigidbody
+{
+static float constexpr TIMESTEP = 1;
+
+struct Particle
+{
+   Particle(int index) : index(index) {}
+   Particle(int index, int width, int height, float mass) : index(index), pos(0, width, 0, height), mass(mass), radius(cbrt(mass)) {}
+
+   const int index;
+   v2d::v2d pos;
+   v2d::v2d vel;
+   v2d::v2d force;
+   uint32_t color = 0x00b894bb;
+   float mass;
+   float radius;
+   bool disabled = false;
+};
+template <int threadCount>
+class Simulation : public Particulo::Particulo<Particle, threadCount>
+{
+public:
+   Simulation(int count) : count(count) {}
+   void init() override {
+      std::uniform_real_distribution<float> massDistr(0, 10);
+      auto particles = this->DangerouslyGet();
+      for (int i = 0; i < count; i++) { particles.push_back(this->NewParticle(Width, Height, massDistr(gen))); }
+      this->DangerouslySet(std::move(particles));
+   }
+   void simulate(const vector<shared_ptr<Particle>>& snapshot, const span<shared_ptr<Particle>> section, milliseconds /*timeElapsed*/) override {
+      for (auto& each : section)
+      {
+         if (each->disabled) { continue; }
+         for (auto& particle : snapshot)
+         {
+            if (particle->disabled) { continue; }
+            if (each->index == particle->index) { continue; }
+            auto p1 = *each;
+            auto p2 = *particle;
+            p1.pos += p1.vel * TIMESTEP;
+            p2.pos += p2.vel * TIMESTEP;
+            float distance = std::sqrt(p1.pos.sqrDist(p2.pos));
+            if (std::abs(distance) < p1.radius + p2.radius)
+            {
+               auto [p1vel, p2vel] = this->CollideElastic(p1, p2);
+               each->vel = p1vel;
+               particle->vel = p2vel;
+            }
+         }
+      }
+   }
+   void update(const vector<shared_ptr<Particle>>& particles, milliseconds /*timeElapsed*/) override {
+      for (auto& each : particles)
+      {
+         if (each->disabled) { continue; }
+         each->pos += each->vel * TIMESTEP;
+      }
+   }
+
+private:
+   int count;
+};
+} // namespace Rigidbody
+
+// Peak resident set size of the process so far, in kilobytes
+static long peakRSS() {
+#ifndef _WIN32
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+   return usage.ru_maxrss / 1024;
+#else
+   return usage.ru_maxrss;
+#endif
+#else
+   return 0;
+#endif
+}
+
+static bool first = true;
+
+template <template <int> class Simulation, int threadCount>
+void measure(const string& name, int count, int steps) {
+   auto sim = make_unique<Simulation<threadCount>>(count);
+   sim->template CreateHeadless<MaxCount>(Width, Height, name);
+   // Warm up caches and the worker threads' first touch of their sections
+   sim->RunHeadless(1);
+   auto start = steady_clock::now();
+   sim->RunHeadless(steps);
+   double seconds = std::chrono::duration<double>(steady_clock::now() - start).count();
+
+   cout << (first ? "" : ",\n") << "    {\"name\": \"" << name << "\", \"particles\": " << count << ", \"threads\": " << threadCount
+        << ", \"steps\": " << steps << ", \"seconds\": " << seconds << ", \"steps_per_sec\": " << steps / seconds
+        << ", \"ns_per_particle_step\": " << seconds * 1e9 / (static_cast<double>(steps) * count) << ", \"peak_rss_kb\": " << peakRSS() << "}";
+   cout.flush();
+}
+
+// ru_maxrss only ever grows, so each configuration runs in a process of its own to get a peak that is its alone.
+// Without fork() they share this one and peak_rss_kb is the peak of everything run so far.
+template <template <int> class Simulation, int threadCount>
+void run(const string& name, int count, int steps) {
+#ifndef _WIN32
+   cout.flush();
+   pid_t child = fork();
+   if (child == 0)
+   {
+      measure<Simulation, threadCount>(name, count, steps);
+      _exit(0);
+   }
+   int status = 0;
+   if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+   {
+      std::cerr << "Benchmark " << name << " with " << count << " particles on " << threadCount << " threads failed" << endl;
+      return;
+   }
+#else
+   measure<Simulation, threadCount>(name, count, steps);
+#endif
+   first = false;
+}
+
+template <template <int> class Simulation>
+void runAll(const string& name, const vector<int>& counts, int steps) {
+   for (auto count : counts)
+   {
+      run<Simulation, 1>(name, count, steps);
+      run<Simulation, 2>(name, count, steps);
+      run<Simulation, 4>(name, count, steps);
+      run<Simulation, 8>(name, count, steps);
+   }
+}
+
+int main(int argc, char** argv) {
+   bool quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+   int scale = quick ? 10 : 1;
+
+   cout << "{\n  \"benchmarks\": [\n";
+   runAll<BouncingBalls::Simulation>("bouncing_balls", {10000 / scale, 100000 / scale, 1000000 / scale}, 200 / scale);
+   runAll<Verlet::Simulation>("verlet", {10000 / scale, 100000 / scale, 1000000 / scale}, 200 / scale);
+   runAll<SolarSystem::Simulation>("solar_system", {1000 / scale, 4000 / scale}, 20 / scale);
+   runAll<Rigidbody::Simulation>("interactive_rigidbody", {1000 / scale, 4000 / scale}, 10 / scale);
+   cout << "\n  ]\n}" << endl;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+
+namespace Particulo
+{
+// Memory resource for particles. Blocks come from a thread-safe pool whose chunks are carved out of one slab sized
+// for maxCount particles, so particles allocated together sit next to each other and allocation never reaches the
+// global heap. Should the slab run out anyway, chunks come from the heap and GetOverflowCount() says how often.
+// Reset() returns everything to the slab in one step.
+class ParticleArena : public std::pmr::memory_resource
+{
+private:
+   // monotonic_buffer_resource is not thread-safe; the pool only calls it to replenish chunks, so a mutex is cheap
+   class LockedUpstream : public std::pmr::memory_resource
+   {
+   public:
+      explicit LockedUpstream(std::pmr::memory_resource* resource) : resource(resource) {}
+
+   private:
+      void* do_allocate(size_t bytes, size_t alignment) override {
+         std::lock_guard lock(mtx);
+         return resource->allocate(bytes, alignment);
+      }
+      void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+         std::lock_guard lock(mtx);
+         resource->deallocate(p, bytes, alignment);
+      }
+      bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+   private:
+      std::pmr::memory_resource* resource;
+      std::mutex mtx;
+   };
+   // Where the slab goes once it's exhausted; counts every chunk it hands out
+   class Overflow : public std::pmr::memory_resource
+   {
+   public:
+      size_t GetCount() const { return count.load(std::memory_order_relaxed); }
+
+   private:
+      void* do_allocate(size_t bytes, size_t alignment) override {
+         count.fetch_add(1, std::memory_order_relaxed);
+         return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+      }
+      void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+         std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+      }
+      bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+   private:
+      std::atomic<size_t> count = 0;
+   };
+
+public:
+   ParticleArena() = default;
+   ParticleArena(const ParticleArena&) = delete;
+   ParticleArena& operator=(const ParticleArena&) = delete;
+
+   // Sizes the slab for `count` blocks of `blockSize` bytes allocated from up to `threads` threads; must be called
+   // before the first allocation
+   void Reserve(size_t count, size_t blockSize, size_t threads) {
+      // The pool rounds blocks up to a size class, at most the next power of two. Its chunks grow geometrically, so
+      // however the blocks are spread over the threads' pools, the chunks hold less than twice the blocks handed out,
+      // each with a bit of the chunk's bitmap. Each thread's pool adds a little bookkeeping of its own.
+      size_t block = std::bit_ceil(blockSize);
+      size_t bytes = 2 * count * block + (2 * count + 7) / 8 + threads * BookkeepingPerThread;
+      // Left uninitialised so untouched capacity is never paged in
+      slab.reset(new std::byte[bytes]);
+      std::pmr::pool_options options;
+      options.max_blocks_per_chunk = count;
+      options.largest_required_pool_block = block;
+      pool.reset();
+      upstream.reset();
+      slabs.reset();
+      slabs = std::make_unique<std::pmr::monotonic_buffer_resource>(slab.get(), bytes, &overflow);
+      upstream = std::make_unique<LockedUpstream>(slabs.get());
+      pool = std::make_unique<std::pmr::synchronized_pool_resource>(options, upstream.get());
+   }
+   // Releases every block at once if no particle is still referenced; returns whether it did
+   bool Reset() {
+      if (live.load() != 0 || !pool) return false;
+      pool->release();
+      slabs->release();
+      return true;
+   }
+   size_t GetLiveCount() const { return live.load(std::memory_order_relaxed); }
+   // Chunks that had to come from the heap because the slab was exhausted
+   size_t GetOverflowCount() const { return overflow.GetCount(); }
+
+private:
+   void* do_allocate(size_t bytes, size_t alignment) override {
+      void* p = pool ? pool->allocate(bytes, alignment) : std::pmr::new_delete_resource()->allocate(bytes, alignment);
+      live.fetch_add(1, std::memory_order_relaxed);
+      return p;
+   }
+   void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+      if (pool) pool->deallocate(p, bytes, alignment);
+      else std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+      live.fetch_sub(1, std::memory_order_relaxed);
+   }
+   bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+   static constexpr size_t BookkeepingPerThread = 16 * 1024;
+
+   Overflow overflow;
+   std::unique_ptr<std::byte[]> slab;
+   std::unique_ptr<std::pmr::monotonic_buffer_resource> slabs;
+   std::unique_ptr<LockedUpstream> upstream;
+   std::unique_ptr<std::pmr::synchronized_pool_resource> pool;
+   std::atomic<size_t> live = 0;
+};
+
+// Allocator for allocate_shared that shares ownership of the arena. The control block keeps a copy, so a particle
+// still referenced after its Particulo instance is gone keeps the arena alive until it is freed.
+template <typename T>
+class ArenaAllocator
+{
+public:
+   using value_type = T;
+
+   explicit ArenaAllocator(std::shared_ptr<ParticleArena> arena) : arena(std::move(arena)) {}
+   template <typename U>
+   ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+   T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+   void deallocate(T* p, size_t n) { arena->deallocate(p, n * sizeof(T), alignof(T)); }
+   template <typename U>
+   bool operator==(const ArenaAllocator<U>& other) const {
+      return arena == other.arena;
+   }
+
+private:
+   template <typename U>
+   friend class ArenaAllocator;
+   std::shared_ptr<ParticleArena> arena;
+};
+} // namespace Particulo
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <glad/glad.h>
+
+namespace Particulo
+{
+// Pixels read back from the framebuffer: RGBA, 8 bits per channel, rows from the top
+struct CapturedFrame
+{
+   uint64_t index = 0;
+   int width = 0;
+   int height = 0;
+   std::vector<uint8_t> pixels;
+};
+
+enum class FrameFormat
+{
+   // One binary PPM file per frame; the path is a printf pattern with exactly one integer conversion for the frame
+   // index, e.g. "frame%05d.ppm", and %% for a literal percent sign
+   PPM,
+   // Every frame appended to one file of raw RGBA, e.g. for `ffmpeg -f rawvideo -pix_fmt rgba`; "-" writes to stdout
+   Raw
+};
+
+// Reads the framebuffer back without stalling the draw loop. Each Queue() starts a glReadPixels into the next pixel
+// buffer object of a ring and fences it; Collect() maps a buffer only once its fence has signaled, so frames come out
+// a couple of frames late instead of waiting for the GPU to finish. Only waits when the ring is full.
+class PixelReadback
+{
+public:
+   static constexpr int RingSize = 3;
+
+public:
+   PixelReadback() = default;
+   PixelReadback(const PixelReadback&) = delete;
+   PixelReadback& operator=(const PixelReadback&) = delete;
+   ~PixelReadback() { Release(); }
+
+   // Needs a current GL context; drops pending reads if the size changes
+   void Resize(int width, int height) {
+      if (width == this->width && height == this->height && buffers[0]) return;
+      Release();
+      this->width = width;
+      this->height = height;
+      glGenBuffers(RingSize, buffers);
+      for (auto buffer : buffers)
+      {
+         glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+         glBufferData(GL_PIXEL_PACK_BUFFER, Bytes(), nullptr, GL_STREAM_READ);
+      }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   }
+   void Release() {
+      if (!buffers[0]) return;
+      for (auto& fence : fences)
+      {
+         if (fence) glDeleteSync(fence);
+         fence = nullptr;
+      }
+      glDeleteBuffers(RingSize, buffers);
+      buffers[0] = 0;
+      pending = 0;
+   }
+   size_t Bytes() const { return static_cast<size_t>(width) * height * 4; }
+   int Pending() const { return pending; }
+   // Reads that were retired without a frame because their fence or mapping failed
+   uint64_t Dropped() const { return dropped; }
+
+   // Starts reading the bound read framebuffer. If the ring is full, the oldest read is retired first, blocking on its
+   // fence, so its buffer is never reused while the GPU may still write it. Returns whether that read produced a frame
+   // in `evicted`.
+   bool Queue(uint64_t index, CapturedFrame& evicted) {
+      bool collected = pending == RingSize && collect(evicted, true);
+      int slot = (head + pending) % RingSize;
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[slot]);
+      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      indices[slot] = index;
+      pending++;
+      return collected;
+   }
+   // Takes the oldest read if the GPU has finished it, or waits for it if `wait` is set. A read that fails is retired
+   // all the same, so waiting always frees a slot; returns whether a frame came out.
+   bool Collect(CapturedFrame& frame, bool wait = false) {
+      if (pending == 0) return false;
+      return collect(frame, wait);
+   }
+
+private:
+   bool collect(CapturedFrame& frame, bool wait) {
+      auto& fence = fences[head];
+      GLenum status = glClientWaitSync(fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? GL_TIMEOUT_IGNORED : 0);
+      if (status == GL_TIMEOUT_EXPIRED) return false;
+      glDeleteSync(fence);
+      fence = nullptr;
+      const uint8_t* mapped = nullptr;
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[head]);
+      if (status != GL_WAIT_FAILED)
+      { mapped = static_cast<const uint8_t*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, Bytes(), GL_MAP_READ_BIT)); }
+      if (mapped)
+      {
+         frame.index = indices[head];
+         frame.width = width;
+         frame.height = height;
+         frame.pixels.resize(Bytes());
+         // GL rows start at the bottom
+         size_t row = static_cast<size_t>(width) * 4;
+         for (int y = 0; y < height; y++) { std::copy_n(mapped + (height - 1 - y) * row, row, frame.pixels.data() + y * row); }
+         glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      }
+      else { dropped++; }
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      head = (head + 1) % RingSize;
+      pending--;
+      return mapped != nullptr;
+   }
+
+private:
+   int width = 0;
+   int height = 0;
+   GLuint buffers[RingSize] = {};
+   GLsync fences[RingSize] = {};
+   uint64_t indices[RingSize] = {};
+   int head = 0;
+   int pending = 0;
+   uint64_t dropped = 0;
+};
+
+// Encodes and writes captured frames on a background thread, so file output never blocks the draw loop. Frames are
+// written in the order they were submitted; Close() waits for the queue to drain.
+class FrameWriter
+{
+public:
+   // Unless `sequence` is false, PPM frames go to files named by the pattern `path`; otherwise every frame is written to
+   // `path` as given, which suits a single screenshot
+   FrameWriter(std::string path, FrameFormat format, bool sequence = true) : path(std::move(path)), format(format), sequence(sequence) {
+      if (format == FrameFormat::PPM && sequence && !IsSequencePattern(this->path))
+      { throw std::logic_error("Frame path " + this->path + " must have exactly one integer conversion, e.g. frame%05d.ppm"); }
+      if (format == FrameFormat::Raw)
+      {
+         file = this->path == "-" ? stdout : fopen(this->path.c_str(), "wb");
+         if (!file) throw std::runtime_error("Unable to open " + this->path);
+      }
+      worker = std::thread([this] { run(); });
+   }
+   FrameWriter(const FrameWriter&) = delete;
+   FrameWriter& operator=(const FrameWriter&) = delete;
+   ~FrameWriter() { Close(); }
+
+   // Whether `pattern` has one integer conversion such as %d or %05d and otherwise only %% escapes, so it can be
+   // formatted with the frame index and nothing else
+   static bool IsSequencePattern(std::string_view pattern) {
+      auto digits = [&](size_t& i) {
+         while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9') { i++; }
+      };
+      int conversions = 0;
+      for (size_t i = 0; i < pattern.size(); i++)
+      {
+         if (pattern[i] != '%') continue;
+         if (++i < pattern.size() && pattern[i] == '%') continue;
+         while (i < pattern.size() && std::string_view("-+ #0").find(pattern[i]) != std::string_view::npos) { i++; }
+         digits(i);
+         if (i < pattern.size() && pattern[i] == '.') digits(++i);
+         if (i >= pattern.size() || std::string_view("diouxX").find(pattern[i]) == std::string_view::npos) return false;
+         conversions++;
+      }
+      return conversions == 1;
+   }
+
+   void Write(CapturedFrame&& frame) {
+      {
+         std::lock_guard lock(mtx);
+         queue.push_back(std::move(frame));
+      }
+      wake.notify_one();
+   }
+   // Frames submitted but not written yet
+   size_t Backlog() {
+      std::lock_guard lock(mtx);
+      return queue.size();
+   }
+   // Frames that could not be written
+   uint64_t Failures() const { return failures; }
+   void Close() {
+      {
+         std::lock_guard lock(mtx);
+         if (closing) return;
+         closing = true;
+      }
+      wake.notify_one();
+      worker.join();
+      if (file && file != stdout) fclose(file);
+      else if (file) fflush(file);
+      file = nullptr;
+   }
+
+private:
+   void run() {
+      while (true)
+      {
+         CapturedFrame frame;
+         {
+            std::unique_lock lock(mtx);
+            wake.wait(lock, [this] { return closing || !queue.empty(); });
+            if (queue.empty()) return;
+            frame = std::move(queue.front());
+            queue.pop_front();
+         }
+         if (!write(frame)) failures++;
+      }
+   }
+   bool write(const CapturedFrame& frame) {
+      if (format == FrameFormat::Raw) return fwrite(frame.pixels.data(), 1, frame.pixels.size(), file) == frame.pixels.size();
+      std::string name = path;
+      if (sequence)
+      {
+         // The constructor checked that the pattern takes exactly the index
+         char formatted[4096];
+         int length = snprintf(formatted, sizeof(formatted), path.c_str(), static_cast<int>(frame.index));
+         if (length < 0 || static_cast<size_t>(length) >= sizeof(formatted)) return false;
+         name = formatted;
+      }
+      FILE* out = fopen(name.c_str(), "wb");
+      if (!out) return false;
+      fprintf(out, "P6\n%d %d\n255\n", frame.width, frame.height);
+      rgb.resize(static_cast<size_t>(frame.width) * 3);
+      bool ok = true;
+      for (int y = 0; y < frame.height && ok; y++)
+      {
+         auto row = frame.pixels.data() + static_cast<size_t>(y) * frame.width * 4;
+         for (int x = 0; x < frame.width; x++)
+         {
+            rgb[x * 3] = row[x * 4];
+            rgb[x * 3 + 1] = row[x * 4 + 1];
+            rgb[x * 3 + 2] = row[x * 4 + 2];
+         }
+         ok = fwrite(rgb.data(), 1, rgb.size(), out) == rgb.size();
+      }
+      return fclose(out) == 0 && ok;
+   }
+
+private:
+   std::string path;
+   FrameFormat format;
+   bool sequence;
+   FILE* file = nullptr;
+   std::vector<uint8_t> rgb;
+   std::thread worker;
+   std::mutex mtx;
+   std::condition_variable wake;
+   std::deque<CapturedFrame> queue;
+   bool closing = false;
+   std::atomic<uint64_t> failures = 0;
+};
+} // namespace Particulo
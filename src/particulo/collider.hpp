@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+#include <math.h>
+#include <vector>
+
+#include "v2d.hpp"
+
+namespace Particulo
+{
+// A thick line segment of static geometry
+struct Segment
+{
+   v2d::v2d a;
+   v2d::v2d b;
+   float halfWidth;
+};
+
+// Bounding volume hierarchy over segments. Built once per geometry change by median splits along the longer axis;
+// queries only visit nodes whose box overlaps the query box, so a particle costs O(log n) however large the scene.
+class SegmentBVH
+{
+private:
+   static constexpr int LeafSize = 4;
+   struct Node
+   {
+      float minX, minY, maxX, maxY;
+      // Inner nodes: index of the first child, the second follows it. Leaves: first segment.
+      uint32_t first;
+      // Number of segments for leaves, 0 for inner nodes
+      uint32_t count;
+   };
+
+public:
+   void Build(std::vector<Segment> segments) {
+      this->segments = std::move(segments);
+      nodes.clear();
+      if (this->segments.empty()) return;
+      nodes.reserve(2 * this->segments.size() / LeafSize + 1);
+      nodes.push_back({});
+      build(0, 0, static_cast<uint32_t>(this->segments.size()));
+   }
+   bool Empty() const { return segments.empty(); }
+   size_t Size() const { return segments.size(); }
+
+   // Calls fn(segment) for every segment whose bounds overlap the box
+   template <typename F>
+   void Query(float minX, float minY, float maxX, float maxY, F&& fn) const {
+      if (nodes.empty()) return;
+      uint32_t stack[64];
+      int top = 0;
+      stack[top++] = 0;
+      while (top > 0)
+      {
+         auto& node = nodes[stack[--top]];
+         if (node.maxX < minX || node.minX > maxX || node.maxY < minY || node.minY > maxY) continue;
+         if (node.count > 0)
+         {
+            for (uint32_t i = node.first; i < node.first + node.count; i++)
+            {
+               auto& s = segments[i];
+               if (std::max(s.a.x, s.b.x) + s.halfWidth < minX || std::min(s.a.x, s.b.x) - s.halfWidth > maxX ||
+                   std::max(s.a.y, s.b.y) + s.halfWidth < minY || std::min(s.a.y, s.b.y) - s.halfWidth > maxY)
+               { continue; }
+               fn(s);
+            }
+         }
+         else
+         {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+         }
+      }
+   }
+
+private:
+   void build(uint32_t index, uint32_t begin, uint32_t end) {
+      Node node = {INFINITY, INFINITY, -INFINITY, -INFINITY, begin, end - begin};
+      for (uint32_t i = begin; i < end; i++)
+      {
+         auto& s = segments[i];
+         node.minX = std::min({node.minX, s.a.x - s.halfWidth, s.b.x - s.halfWidth});
+         node.minY = std::min({node.minY, s.a.y - s.halfWidth, s.b.y - s.halfWidth});
+         node.maxX = std::max({node.maxX, s.a.x + s.halfWidth, s.b.x + s.halfWidth});
+         node.maxY = std::max({node.maxY, s.a.y + s.halfWidth, s.b.y + s.halfWidth});
+      }
+      if (end - begin > LeafSize)
+      {
+         bool splitX = node.maxX - node.minX > node.maxY - node.minY;
+         uint32_t middle = begin + (end - begin) / 2;
+         std::nth_element(segments.begin() + begin, segments.begin() + middle, segments.begin() + end, [splitX](const Segment& l, const Segment& r) {
+            return splitX ? l.a.x + l.b.x < r.a.x + r.b.x : l.a.y + l.b.y < r.a.y + r.b.y;
+         });
+         node.first = static_cast<uint32_t>(nodes.size());
+         node.count = 0;
+         nodes.push_back({});
+         nodes.push_back({});
+         build(node.first, begin, middle);
+         build(node.first + 1, middle, end);
+      }
+      nodes[index] = node;
+   }
+
+private:
+   std::vector<Segment> segments;
+   std::vector<Node> nodes;
+};
+
+// Pushes a circular particle out of a segment it overlaps and reflects the velocity's normal component, scaled by
+// `restitution`. Uses `vel` or, for Verlet integration, `prev_pos` when the particle has them. Returns whether they
+// touched.
+template <typename P>
+bool ResolveCollision(P& p, const Segment& segment, float restitution) {
+   auto ab = segment.b - segment.a;
+   auto ap = p.pos - segment.a;
+   float lengthSquared = ab.x * ab.x + ab.y * ab.y;
+   float t = lengthSquared > 0.0f ? std::clamp((ap.x * ab.x + ap.y * ab.y) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+   auto delta = p.pos - (segment.a + ab * t);
+   float reach = p.radius + segment.halfWidth;
+   float distanceSquared = delta.x * delta.x + delta.y * delta.y;
+   if (distanceSquared >= reach * reach) return false;
+   float distance = sqrtf(distanceSquared);
+   // A particle centered exactly on the line is pushed out perpendicular to it
+   auto normal = distance > 0.0f ? delta / distance : v2d::v2d(-ab.y, ab.x) / std::max(sqrtf(lengthSquared), 1e-6f);
+   auto reflect = [&](v2d::v2d v) {
+      float vn = v.x * normal.x + v.y * normal.y;
+      return vn < 0.0f ? v - normal * ((1.0f + restitution) * vn) : v;
+   };
+   if constexpr (requires { { p.prev_pos } -> std::same_as<v2d::v2d&>; })
+   {
+      auto velocity = reflect(p.pos - p.prev_pos);
+      p.pos += normal * (reach - distance);
+      p.prev_pos = p.pos - velocity;
+   }
+   else
+   {
+      p.pos += normal * (reach - distance);
+      if constexpr (requires { { p.vel } -> std::same_as<v2d::v2d&>; }) { p.vel = reflect(p.vel); }
+   }
+   return true;
+}
+} // namespace Particulo
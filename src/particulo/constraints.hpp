@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <math.h>
+#include <utility>
+#include <vector>
+
+#include "slot_map.hpp"
+#include "v2d.hpp"
+
+namespace Particulo
+{
+// Distance constraints solved with XPBD (extended position-based dynamics). Columns are stored contiguously and sorted
+// by graph color: no two constraints of one color share a particle, so each color can be split across the workers
+// and projected without atomics. A bend constraint keeps the two outer particles of a hinge a->b->c at their rest
+// distance, which resists folding at b; it is colored by all three particles.
+class ConstraintSet
+{
+public:
+   // Constraints sharing a particle with 64 others go into one final color that a single worker projects
+   static constexpr int MaxColors = 64;
+
+public:
+   void AddDistance(ParticleHandle a, ParticleHandle b, float rest, float compliance) { add(a, b, {}, rest, compliance); }
+   void AddBend(ParticleHandle a, ParticleHandle b, ParticleHandle c, float rest, float compliance) { add(a, c, b, rest, compliance); }
+   void Append(const ConstraintSet& other) {
+      first.insert(first.end(), other.first.begin(), other.first.end());
+      second.insert(second.end(), other.second.begin(), other.second.end());
+      hinge.insert(hinge.end(), other.hinge.begin(), other.hinge.end());
+      rest.insert(rest.end(), other.rest.begin(), other.rest.end());
+      compliance.insert(compliance.end(), other.compliance.begin(), other.compliance.end());
+      lambda.resize(first.size());
+   }
+   void Clear() {
+      first.clear();
+      second.clear();
+      hinge.clear();
+      rest.clear();
+      compliance.clear();
+      lambda.clear();
+      colorStart.clear();
+   }
+   bool Empty() const { return first.empty(); }
+   size_t Size() const { return first.size(); }
+
+   // Greedy coloring, then a stable counting sort of every column by color
+   void Color() {
+      vector<uint64_t> used;
+      vector<uint8_t> colorOf(Size());
+      auto usedBy = [&](ParticleHandle h) -> uint64_t& {
+         if (h.slot >= used.size()) used.resize(h.slot + 1, 0);
+         return used[h.slot];
+      };
+      for (size_t i = 0; i < Size(); i++)
+      {
+         uint64_t taken = usedBy(first[i]) | usedBy(second[i]) | (hinge[i].slot != ~0u ? usedBy(hinge[i]) : 0);
+         int color = taken == ~0ull ? MaxColors : std::countr_one(taken);
+         colorOf[i] = static_cast<uint8_t>(color);
+         if (color == MaxColors) continue;
+         usedBy(first[i]) |= 1ull << color;
+         usedBy(second[i]) |= 1ull << color;
+         if (hinge[i].slot != ~0u) usedBy(hinge[i]) |= 1ull << color;
+      }
+      colorStart.assign(MaxColors + 2, 0);
+      for (auto color : colorOf) { colorStart[color + 1]++; }
+      for (size_t c = 1; c < colorStart.size(); c++) { colorStart[c] += colorStart[c - 1]; }
+      vector<size_t> order(Size());
+      auto cursor = colorStart;
+      for (size_t i = 0; i < Size(); i++) { order[cursor[colorOf[i]]++] = i; }
+      permute(first, order);
+      permute(second, order);
+      permute(hinge, order);
+      permute(rest, order);
+      permute(compliance, order);
+      lambda.assign(Size(), 0.0f);
+      // Drop trailing empty colors so workers don't wait on barriers with nothing to do
+      while (colorStart.size() > 1 && colorStart[colorStart.size() - 2] == colorStart.back()) { colorStart.pop_back(); }
+   }
+   int ColorCount() const { return colorStart.empty() ? 0 : static_cast<int>(colorStart.size()) - 1; }
+   // The overflow color may not be split across workers
+   bool IsSerial(int color) const { return color == MaxColors; }
+   size_t ColorBegin(int color) const { return colorStart[color]; }
+   size_t ColorEnd(int color) const { return colorStart[color + 1]; }
+   void ResetLambda() { std::fill(lambda.begin(), lambda.end(), 0.0f); }
+   // Drops the constraints on particles for which `alive` returns false. Removing constraints never breaks a coloring,
+   // so the rest keep their colors and order.
+   template <typename Alive>
+   void Prune(Alive&& alive) {
+      size_t kept = 0;
+      size_t begin = 0;
+      for (int color = 0; color < ColorCount(); color++)
+      {
+         size_t end = colorStart[color + 1];
+         for (size_t i = std::exchange(begin, end); i < end; i++)
+         {
+            if (!alive(first[i]) || !alive(second[i]) || (hinge[i].slot != ~0u && !alive(hinge[i]))) continue;
+            first[kept] = first[i];
+            second[kept] = second[i];
+            hinge[kept] = hinge[i];
+            rest[kept] = rest[i];
+            compliance[kept] = compliance[i];
+            lambda[kept] = lambda[i];
+            kept++;
+         }
+         colorStart[color + 1] = kept;
+      }
+      first.resize(kept);
+      second.resize(kept);
+      hinge.resize(kept);
+      rest.resize(kept);
+      compliance.resize(kept);
+      lambda.resize(kept);
+      while (colorStart.size() > 1 && colorStart[colorStart.size() - 2] == colorStart.back()) { colorStart.pop_back(); }
+      if (kept == 0) colorStart.clear();
+   }
+
+   // One XPBD projection of constraint i over a step of `dt` seconds. `find` maps a handle to a particle pointer, or
+   // nullptr if it was removed.
+   template <typename Find>
+   void Project(size_t i, float dt, Find&& find) {
+      auto a = find(first[i]);
+      auto b = find(second[i]);
+      if (!a || !b) return;
+      float wa = inverseMass(*a);
+      float wb = inverseMass(*b);
+      auto delta = a->pos - b->pos;
+      float length = sqrtf(delta.x * delta.x + delta.y * delta.y);
+      if (length == 0.0f || wa + wb == 0.0f) return;
+      auto normal = delta / length;
+      float alpha = compliance[i] / (dt * dt);
+      float dLambda = (-(length - rest[i]) - alpha * lambda[i]) / (wa + wb + alpha);
+      lambda[i] += dLambda;
+      correct(*a, normal * (wa * dLambda), dt);
+      correct(*b, normal * (-wb * dLambda), dt);
+   }
+
+   // Calls fn(a, b) with the handles of each constraint's two constrained particles
+   template <typename F>
+   void ForEachPair(F&& fn) const {
+      for (size_t i = 0; i < Size(); i++) { fn(first[i], second[i]); }
+   }
+
+private:
+   void add(ParticleHandle a, ParticleHandle b, ParticleHandle h, float restLength, float complianceValue) {
+      first.push_back(a);
+      second.push_back(b);
+      hinge.push_back(h);
+      rest.push_back(restLength);
+      compliance.push_back(complianceValue);
+      lambda.push_back(0.0f);
+   }
+   template <typename V>
+   static void permute(vector<V>& column, const vector<size_t>& order) {
+      vector<V> sorted(column.size());
+      for (size_t i = 0; i < order.size(); i++) { sorted[i] = column[order[i]]; }
+      column = std::move(sorted);
+   }
+   // Particles with a `mass` use its inverse, so a mass of 0 pins them; others weigh 1
+   template <typename P>
+   static float inverseMass(const P& p) {
+      if constexpr (requires { { p.mass } -> std::convertible_to<float>; }) { return p.mass > 0 ? 1.0f / p.mass : 0.0f; }
+      else { return 1.0f; }
+   }
+   // Moves a particle and keeps its velocity consistent with the move: Verlet particles carry it implicitly, others
+   // with a `vel` get the correction divided by the step
+   template <typename P>
+   static void correct(P& p, v2d::v2d correction, float dt) {
+      p.pos += correction;
+      if constexpr (!requires { p.prev_pos; } && requires { { p.vel } -> std::same_as<v2d::v2d&>; }) { p.vel += correction / dt; }
+   }
+
+private:
+   vector<ParticleHandle> first;
+   vector<ParticleHandle> second;
+   // Middle particle of bend constraints; only used for coloring
+   vector<ParticleHandle> hinge;
+   vector<float> rest;
+   vector<float> compliance;
+   vector<float> lambda;
+   vector<size_t> colorStart;
+};
+} // namespace Particulo
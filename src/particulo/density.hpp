@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "domain.hpp"
+#include "v2d.hpp"
+
+namespace Particulo
+{
+// Persistent helper threads that run one function on every worker and return once all of them are done. The calling
+// thread takes worker 0, so a pool of n workers starts n - 1 threads.
+class WorkerPool
+{
+public:
+   // `onStart` runs on each helper thread before it takes any work, e.g. to name it
+   explicit WorkerPool(int workers, std::function<void(int)> onStart = {}) : workers(std::max(workers, 1)) {
+      for (int i = 1; i < this->workers; i++)
+      {
+         threads.emplace_back([this, i, onStart] {
+            if (onStart) onStart(i);
+            loop(i);
+         });
+      }
+   }
+   ~WorkerPool() {
+      {
+         std::lock_guard lock(mtx);
+         stopping = true;
+      }
+      wake.notify_all();
+      for (auto& thread : threads) { thread.join(); }
+   }
+   WorkerPool(const WorkerPool&) = delete;
+   WorkerPool& operator=(const WorkerPool&) = delete;
+
+   int Size() const { return workers; }
+   // Calls fn(worker) once for every worker in [0, Size()) and waits for all of them
+   void Run(const std::function<void(int)>& fn) {
+      {
+         std::lock_guard lock(mtx);
+         job = &fn;
+         pending = workers - 1;
+         generation++;
+      }
+      wake.notify_all();
+      fn(0);
+      std::unique_lock lock(mtx);
+      done.wait(lock, [this] { return pending == 0; });
+      job = nullptr;
+   }
+
+private:
+   void loop(int worker) {
+      uint64_t seen = 0;
+      while (true)
+      {
+         const std::function<void(int)>* fn;
+         {
+            std::unique_lock lock(mtx);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            fn = job;
+         }
+         (*fn)(worker);
+         std::lock_guard lock(mtx);
+         if (--pending == 0) done.notify_one();
+      }
+   }
+
+private:
+   int workers;
+   std::vector<std::thread> threads;
+   std::mutex mtx;
+   std::condition_variable wake;
+   std::condition_variable done;
+   const std::function<void(int)>* job = nullptr;
+   uint64_t generation = 0;
+   int pending = 0;
+   bool stopping = false;
+};
+
+// 2D affine map (x, y) -> (a x + b y + tx, c x + d y + ty)
+struct Affine2D
+{
+   float a = 1.0f, b = 0.0f, c = 0.0f, d = 1.0f;
+   float tx = 0.0f, ty = 0.0f;
+
+   v2d::v2d Apply(v2d::v2d p) const { return v2d::v2d(a * p.x + b * p.y + tx, c * p.x + d * p.y + ty); }
+   float Determinant() const { return a * d - b * c; }
+   // Only valid if the determinant isn't 0
+   Affine2D Inverse() const {
+      float det = Determinant();
+      return {d / det, -b / det, -c / det, a / det, (b * ty - d * tx) / det, (c * tx - a * ty) / det};
+   }
+};
+
+// Screen-resolution particle counts, for drawing systems too large for one quad per particle as a heatmap. Each worker
+// counts its share of the particles into a private grid, then the grids are summed in bands of rows, so no pixel is
+// written by two threads. Everything after the counting pass costs in proportion to the pixel count.
+class DensityMap
+{
+public:
+   void Resize(int width, int height, int workers) {
+      if (width == this->width && height == this->height && static_cast<int>(grids.size()) == workers) return;
+      this->width = std::max(width, 0);
+      this->height = std::max(height, 0);
+      size_t pixels = static_cast<size_t>(this->width) * this->height;
+      grids.assign(workers, std::vector<float>(pixels, 0.0f));
+      maxima.assign(workers, 0.0f);
+   }
+   int GetWidth() const { return width; }
+   int GetHeight() const { return height; }
+
+   // Counts this worker's share of the particles into its grid; `toPixels` maps world positions to pixels with row 0
+   // at the bottom
+   template <typename Particles>
+   void Splat(const Particles& particles, const Affine2D& toPixels, int worker) {
+      Splat(particles.size(), [&](size_t i) { return PositionOf(*particles[i]); }, toPixels, worker);
+   }
+   // Same for `count` positions given by position(i)
+   template <typename Position>
+   void Splat(size_t count, Position&& position, const Affine2D& toPixels, int worker) {
+      auto& grid = grids[worker];
+      std::fill(grid.begin(), grid.end(), 0.0f);
+      size_t share = count / grids.size();
+      size_t begin = worker * share;
+      size_t end = worker < static_cast<int>(grids.size()) - 1 ? begin + share : count;
+      for (size_t i = begin; i < end; i++)
+      {
+         auto pixel = toPixels.Apply(position(i));
+         if (!(pixel.x >= 0.0f && pixel.y >= 0.0f && pixel.x < width && pixel.y < height)) continue;
+         grid[static_cast<size_t>(pixel.y) * width + static_cast<size_t>(pixel.x)] += 1.0f;
+      }
+   }
+   // Sums this worker's band of rows of every grid into the first; call after all workers have splatted
+   void Reduce(int worker) {
+      int share = height / static_cast<int>(grids.size());
+      size_t begin = static_cast<size_t>(worker * share) * width;
+      size_t end = static_cast<size_t>(worker < static_cast<int>(grids.size()) - 1 ? (worker + 1) * share : height) * width;
+      float peak = 0.0f;
+      auto& total = grids[0];
+      for (size_t g = 1; g < grids.size(); g++)
+      {
+         auto& grid = grids[g];
+         for (size_t i = begin; i < end; i++) { total[i] += grid[i]; }
+      }
+      for (size_t i = begin; i < end; i++) { peak = std::max(peak, total[i]); }
+      maxima[worker] = peak;
+   }
+   // Particles per pixel, row by row from the bottom; valid after Reduce()
+   const float* Data() const { return grids.empty() ? nullptr : grids[0].data(); }
+   float Max() const { return maxima.empty() ? 0.0f : *std::max_element(maxima.begin(), maxima.end()); }
+
+private:
+   int width = 0;
+   int height = 0;
+   std::vector<std::vector<float>> grids;
+   std::vector<float> maxima;
+};
+} // namespace Particulo
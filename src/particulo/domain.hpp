@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+#include <math.h>
+#include <memory>
+#include <vector>
+
+#include "v2d.hpp"
+
+namespace Particulo
+{
+enum class Boundary
+{
+   // Particles may leave the domain
+   None,
+   // Particles bounce off the walls
+   Reflect,
+   // Particles leaving one side re-enter from the opposite side
+   Wrap,
+   // Particles are removed once they leave
+   Absorb
+};
+
+template <typename P>
+v2d::v2d PositionOf(const P& particle) {
+   if constexpr (requires { particle.pos; }) { return particle.pos; }
+   else { return v2d::v2d(particle.x, particle.y); }
+}
+
+// Rectangular simulation domain with a boundary condition per axis
+struct Domain
+{
+   float minX = 0.0f;
+   float minY = 0.0f;
+   float maxX = 0.0f;
+   float maxY = 0.0f;
+   Boundary boundaryX = Boundary::None;
+   Boundary boundaryY = Boundary::None;
+
+   static Domain Uniform(float minX, float minY, float maxX, float maxY, Boundary boundary) {
+      return {minX, minY, maxX, maxY, boundary, boundary};
+   }
+
+   bool Active() const { return boundaryX != Boundary::None || boundaryY != Boundary::None; }
+   bool Absorbs() const { return boundaryX == Boundary::Absorb || boundaryY == Boundary::Absorb; }
+
+   // Shortest displacement from a to b, across the wrapped edges where the domain is periodic
+   v2d::v2d Displacement(v2d::v2d a, v2d::v2d b) const {
+      auto delta = b - a;
+      if (boundaryX == Boundary::Wrap) delta.x = minimumImage(delta.x, maxX - minX);
+      if (boundaryY == Boundary::Wrap) delta.y = minimumImage(delta.y, maxY - minY);
+      return delta;
+   }
+
+   // Enforces the boundaries on a particle. Reflection mirrors `vel` and, for Verlet integration, `prev_pos` when the
+   // particle has them. Returns false if the particle left through an absorbing boundary.
+   template <typename P>
+   bool Apply(P& p) const {
+      float *x, *y, *prevX = nullptr, *prevY = nullptr, *velX = nullptr, *velY = nullptr;
+      if constexpr (requires { p.pos; })
+      {
+         x = &p.pos.x;
+         y = &p.pos.y;
+      }
+      else
+      {
+         x = &p.x;
+         y = &p.y;
+      }
+      if constexpr (requires { { p.prev_pos } -> std::same_as<v2d::v2d&>; })
+      {
+         prevX = &p.prev_pos.x;
+         prevY = &p.prev_pos.y;
+      }
+      if constexpr (requires { { p.vel } -> std::same_as<v2d::v2d&>; })
+      {
+         velX = &p.vel.x;
+         velY = &p.vel.y;
+      }
+      return applyAxis(*x, prevX, velX, minX, maxX, boundaryX) && applyAxis(*y, prevY, velY, minY, maxY, boundaryY);
+   }
+
+private:
+   static float minimumImage(float delta, float size) { return size > 0.0f ? delta - size * roundf(delta / size) : delta; }
+
+   static bool applyAxis(float& x, float* prev, float* vel, float min, float max, Boundary boundary) {
+      switch (boundary)
+      {
+      case Boundary::None: return true;
+      case Boundary::Absorb: return x >= min && x <= max;
+      case Boundary::Reflect: {
+         float wall;
+         if (x < min) wall = min;
+         else if (x > max) wall = max;
+         else return true;
+         // Clamped, since a particle that overshot by more than the domain's size is still outside after one mirror
+         x = std::min(std::max(2.0f * wall - x, min), max);
+         if (prev) *prev = 2.0f * wall - *prev;
+         if (vel) *vel = -*vel;
+         return true;
+      }
+      case Boundary::Wrap: {
+         float size = max - min;
+         // An empty domain has nothing to wrap around, so it behaves like None
+         if (size <= 0.0f || (x >= min && x < max)) return true;
+         float shift = size * floorf((x - min) / size);
+         x -= shift;
+         if (prev) *prev -= shift;
+         return true;
+      }
+      }
+      return true;
+   }
+};
+
+// Uniform grid over a domain, rebuilt from the snapshot after every step, for neighbour queries in simulate(). Positions
+// are copied into the grid in cell order, so a query reads contiguous memory instead of chasing particle pointers. On
+// wrapped axes a query near an edge continues into the cells on the opposite side ("ghost cells") and reports those
+// particles at their periodic image next to the query point, so periodic neighbour search needs no special cases in
+// user code.
+class SpatialGrid
+{
+public:
+   // Cells are at least `cellSize` wide; on wrapped axes they are stretched slightly to tile the domain exactly
+   void Configure(const Domain& domain, float cellSize) {
+      this->domain = domain;
+      float width = domain.maxX - domain.minX;
+      float height = domain.maxY - domain.minY;
+      cols = std::max(1, static_cast<int>(width / cellSize));
+      rows = std::max(1, static_cast<int>(height / cellSize));
+      cellWidth = width / cols;
+      cellHeight = height / rows;
+      cellStart.assign(static_cast<size_t>(cols) * rows + 1, 0);
+      entries.clear();
+   }
+   bool Enabled() const { return cols > 0; }
+   bool Wraps() const { return wrapsX() || wrapsY(); }
+   const Domain& GetBounds() const { return domain; }
+   float CellSize() const { return std::max(cellWidth, cellHeight); }
+   // Largest particle radius as of the last build, for queries that must find particles overlapping a region
+   float MaxRadius() const { return maxRadius; }
+   void Disable() {
+      cols = rows = 0;
+      cellStart.clear();
+      entries.clear();
+      positions.clear();
+   }
+
+   // Counting sort of the particles by cell
+   template <typename Particles>
+   void Build(const Particles& particles) {
+      if (!Enabled()) return;
+      cellOf.resize(particles.size());
+      wrapped.resize(particles.size());
+      std::fill(cellStart.begin(), cellStart.end(), 0);
+      maxRadius = 0.0f;
+      for (size_t i = 0; i < particles.size(); i++)
+      {
+         if constexpr (requires { particles[i]->radius; }) maxRadius = std::max(maxRadius, static_cast<float>(particles[i]->radius));
+         auto pos = PositionOf(*particles[i]);
+         // Particles may have moved past a wrapped edge in update(), after the boundaries were applied
+         if (wrapsX()) pos.x -= (domain.maxX - domain.minX) * floorf((pos.x - domain.minX) / (domain.maxX - domain.minX));
+         if (wrapsY()) pos.y -= (domain.maxY - domain.minY) * floorf((pos.y - domain.minY) / (domain.maxY - domain.minY));
+         wrapped[i] = pos;
+         auto x = cell(pos.x - domain.minX, cellWidth, cols, wrapsX());
+         auto y = cell(pos.y - domain.minY, cellHeight, rows, wrapsY());
+         cellOf[i] = static_cast<uint32_t>(cellIndex(x, y));
+         cellStart[cellOf[i] + 1]++;
+      }
+      for (size_t c = 1; c < cellStart.size(); c++) { cellStart[c] += cellStart[c - 1]; }
+      entries.resize(particles.size());
+      positions.resize(particles.size());
+      cursor.assign(cellStart.begin(), cellStart.end() - 1);
+      for (size_t i = 0; i < particles.size(); i++)
+      {
+         auto e = cursor[cellOf[i]]++;
+         entries[e] = static_cast<uint32_t>(i);
+         positions[e] = wrapped[i];
+      }
+   }
+   void Clear() {
+      std::fill(cellStart.begin(), cellStart.end(), 0);
+      entries.clear();
+      positions.clear();
+      maxRadius = 0.0f;
+   }
+
+   // Calls fn(index) for every particle filed in a cell overlapping the box. Particles outside the domain are filed in
+   // the nearest edge cell, so the box is clamped rather than wrapped.
+   template <typename F>
+   void ForEachInBox(float minX, float minY, float maxX, float maxY, F&& fn) const {
+      if (!Enabled() || entries.empty()) return;
+      if (maxX < minX || maxY < minY) return;
+      int x0 = clampedCell(minX - domain.minX, cellWidth, cols);
+      int x1 = clampedCell(maxX - domain.minX, cellWidth, cols);
+      int y0 = clampedCell(minY - domain.minY, cellHeight, rows);
+      int y1 = clampedCell(maxY - domain.minY, cellHeight, rows);
+      for (int cy = y0; cy <= y1; cy++)
+      {
+         // Cells of a row are adjacent, so the row is one contiguous run of entries
+         for (auto e = cellStart[cellIndex(x0, cy)]; e < cellStart[cellIndex(x1, cy) + 1]; e++) { fn(entries[e]); }
+      }
+   }
+
+   // Calls fn(index, position) for every particle in the cells overlapping the square of half-size `radius` around pos.
+   // `index` is the particle's position in the snapshot and `position` its location as of the snapshot, shifted to the
+   // periodic image next to `pos` on wrapped axes.
+   template <typename F>
+   void ForEachNeighbor(v2d::v2d pos, float radius, F&& fn) const {
+      if (!Enabled() || entries.empty()) return;
+      int x0, x1, y0, y1;
+      span(pos.x - domain.minX, radius, cellWidth, cols, wrapsX(), x0, x1);
+      span(pos.y - domain.minY, radius, cellHeight, rows, wrapsY(), y0, y1);
+      float width = domain.maxX - domain.minX;
+      float height = domain.maxY - domain.minY;
+      for (int cy = y0; cy <= y1; cy++)
+      {
+         int wy = wrap(cy, rows);
+         float offsetY = static_cast<float>((cy - wy) / rows) * height;
+         for (int cx = x0; cx <= x1; cx++)
+         {
+            int wx = wrap(cx, cols);
+            auto offset = v2d::v2d(static_cast<float>((cx - wx) / cols) * width, offsetY);
+            auto c = cellIndex(wx, wy);
+            for (auto e = cellStart[c]; e < cellStart[c + 1]; e++) { fn(entries[e], positions[e] + offset); }
+         }
+      }
+   }
+
+private:
+   // Empty axes don't wrap, like Domain::Apply()
+   bool wrapsX() const { return domain.boundaryX == Boundary::Wrap && domain.maxX > domain.minX; }
+   bool wrapsY() const { return domain.boundaryY == Boundary::Wrap && domain.maxY > domain.minY; }
+   size_t cellIndex(int x, int y) const { return static_cast<size_t>(y) * cols + x; }
+   static int wrap(int c, int count) { return ((c % count) + count) % count; }
+   static int cell(float offset, float size, int count, bool wraps) {
+      int c = static_cast<int>(floorf(offset / size));
+      return wraps ? wrap(c, count) : std::clamp(c, 0, count - 1);
+   }
+   // Clamped in floating point first, so far-away offsets don't overflow the conversion
+   static int clampedCell(float offset, float size, int count) {
+      return static_cast<int>(std::clamp(floorf(offset / size), 0.0f, static_cast<float>(count - 1)));
+   }
+   // Range of cells covered by [offset - radius, offset + radius]; unwrapped on periodic axes, clamped otherwise
+   static void span(float offset, float radius, float size, int count, bool wraps, int& first, int& last) {
+      first = static_cast<int>(floorf((offset - radius) / size));
+      last = static_cast<int>(floorf((offset + radius) / size));
+      if (wraps) last = std::min(last, first + count - 1);
+      else
+      {
+         first = std::clamp(first, 0, count - 1);
+         last = std::clamp(last, 0, count - 1);
+      }
+   }
+
+private:
+   Domain domain;
+   int cols = 0;
+   int rows = 0;
+   float cellWidth = 0.0f;
+   float cellHeight = 0.0f;
+   float maxRadius = 0.0f;
+   std::vector<uint32_t> cellStart;
+   std::vector<uint32_t> entries;
+   std::vector<v2d::v2d> positions;
+   std::vector<uint32_t> cellOf;
+   std::vector<v2d::v2d> wrapped;
+   std::vector<uint32_t> cursor;
+};
+} // namespace Particulo
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <math.h>
+#include <random>
+
+#include "v2d.hpp"
+
+namespace Particulo
+{
+// Spawns particles at a steady rate. Spawns are generated by the worker threads at the start of each step and added
+// to the simulation together when the step completes. Emitters set a particle's position and color, its velocity if
+// it has a v2d `vel` member, and its radius if `radius` is positive; everything else comes from T(int index).
+class Emitter
+{
+public:
+   enum class Shape
+   {
+      Point,
+      Line,
+      Disc,
+      Region
+   };
+
+public:
+   static Emitter Point(v2d::v2d position, float rate) { return Emitter(Shape::Point, position, position, rate); }
+   static Emitter Line(v2d::v2d from, v2d::v2d to, float rate) { return Emitter(Shape::Line, from, to, rate); }
+   static Emitter Disc(v2d::v2d center, float radius, float rate) {
+      auto emitter = Emitter(Shape::Disc, center, center, rate);
+      emitter.discRadius = radius;
+      return emitter;
+   }
+   // Axis-aligned rectangle between two corners
+   static Emitter Region(v2d::v2d min, v2d::v2d max, float rate) { return Emitter(Shape::Region, min, max, rate); }
+
+public:
+   // Uniformly distributed over the emitter's shape
+   template <typename Generator>
+   v2d::v2d SamplePosition(Generator& gen) const {
+      std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+      switch (shape)
+      {
+      case Shape::Point: return a;
+      case Shape::Line: return a + (b - a) * unit(gen);
+      case Shape::Disc: {
+         float r = discRadius * sqrtf(unit(gen));
+         float theta = unit(gen) * 2.0f * static_cast<float>(M_PI);
+         return a + v2d::v2d(r * cosf(theta), r * sinf(theta));
+      }
+      case Shape::Region: return v2d::v2d(a.x + (b.x - a.x) * unit(gen), a.y + (b.y - a.y) * unit(gen));
+      }
+      return a;
+   }
+   // Speed uniform in [minSpeed, maxSpeed], direction uniform within `spread` radians centered on `direction`
+   template <typename Generator>
+   v2d::v2d SampleVelocity(Generator& gen) const {
+      std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+      float speed = minSpeed + (maxSpeed - minSpeed) * unit(gen);
+      float theta = direction + spread * (unit(gen) - 0.5f);
+      return v2d::v2d(speed * cosf(theta), speed * sinf(theta));
+   }
+
+public:
+   Shape shape;
+   v2d::v2d a;
+   v2d::v2d b;
+   float discRadius = 0.0f;
+   // Particles per second of simulation
+   float rate;
+   // Seconds until a spawned particle is removed
+   float lifetime = std::numeric_limits<float>::infinity();
+   float direction = 0.0f;
+   float spread = 2.0f * static_cast<float>(M_PI);
+   float minSpeed = 0.0f;
+   float maxSpeed = 0.0f;
+   uint32_t color = 0xffffffff;
+   float radius = 0.0f;
+
+private:
+   Emitter(Shape shape, v2d::v2d a, v2d::v2d b, float rate) : shape(shape), a(a), b(b), rate(rate) {}
+};
+} // namespace Particulo
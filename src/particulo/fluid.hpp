@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <math.h>
+#include <memory>
+#include <vector>
+
+#include "domain.hpp"
+#include "v2d.hpp"
+
+namespace Particulo
+{
+struct FluidParams
+{
+   // Kernel support radius; particles further apart than this don't interact
+   float smoothingLength = 10.0f;
+   float restDensity = 1.0f;
+   // Pressure per unit of density above rest density
+   float stiffness = 1000.0f;
+   // Kinematic viscosity
+   float viscosity = 1.0f;
+   float particleMass = 50.0f;
+};
+
+// Weakly compressible SPH with a 2D cubic spline kernel. Neighbours come from the spatial grid, so positions are
+// those of the snapshot. Work is split in two passes over disjoint snapshot ranges, one per worker: Density() fills
+// the density, pressure and velocity columns, and after a barrier Accelerations() reads them for every neighbour.
+class Fluid
+{
+public:
+   void Configure(const FluidParams& params) {
+      this->params = params;
+      float h = params.smoothingLength;
+      sigma = 40.0f / (7.0f * static_cast<float>(M_PI) * h * h);
+   }
+   const FluidParams& GetParams() const { return params; }
+   // Sizes the columns for a snapshot; call while no pass is running
+   void Prepare(size_t count) {
+      density.resize(count);
+      pressure.resize(count);
+      velocity.resize(count);
+   }
+   float Density(size_t index) const { return density[index]; }
+   float Pressure(size_t index) const { return pressure[index]; }
+
+   float Kernel(float r) const {
+      float q = r / params.smoothingLength;
+      if (q <= 0.5f) return sigma * (6.0f * q * q * q - 6.0f * q * q + 1.0f);
+      if (q <= 1.0f) return sigma * 2.0f * (1.0f - q) * (1.0f - q) * (1.0f - q);
+      return 0.0f;
+   }
+   // dW/dr
+   float KernelDerivative(float r) const {
+      float h = params.smoothingLength;
+      float q = r / h;
+      if (q <= 0.5f) return sigma / h * (18.0f * q * q - 12.0f * q);
+      if (q <= 1.0f) return sigma / h * -6.0f * (1.0f - q) * (1.0f - q);
+      return 0.0f;
+   }
+
+   // Density and pressure of snapshot[begin, end); also records their velocities for the second pass
+   template <typename Particles>
+   void Density(const Particles& snapshot, const SpatialGrid& grid, size_t begin, size_t end) {
+      float h = params.smoothingLength;
+      for (size_t i = begin; i < end; i++)
+      {
+         auto pos = snapshot[i]->pos;
+         float rho = 0.0f;
+         grid.ForEachNeighbor(pos, h, [&](uint32_t j, v2d::v2d other) {
+            float r2 = pos.sqrDist(other);
+            if (r2 < h * h) rho += Kernel(sqrtf(r2));
+         });
+         density[i] = std::max(rho * params.particleMass, 1e-6f);
+         pressure[i] = params.stiffness * std::max(density[i] - params.restDensity, 0.0f);
+         velocity[i] = snapshot[i]->vel;
+      }
+   }
+   // Adds pressure and viscosity accelerations times dt to the velocities of snapshot[begin, end)
+   template <typename Particles>
+   void Accelerations(const Particles& snapshot, const SpatialGrid& grid, size_t begin, size_t end, float dt) {
+      float h = params.smoothingLength;
+      float m = params.particleMass;
+      // Brookshaw's Laplacian approximation, 2(d + 2) with d = 2
+      float viscosity = 8.0f * params.viscosity;
+      for (size_t i = begin; i < end; i++)
+      {
+         auto pos = snapshot[i]->pos;
+         float pressureTerm = pressure[i] / (density[i] * density[i]);
+         v2d::v2d acceleration;
+         grid.ForEachNeighbor(pos, h, [&](uint32_t j, v2d::v2d other) {
+            if (j == i) return;
+            auto rij = pos - other;
+            float r2 = rij.x * rij.x + rij.y * rij.y;
+            if (r2 >= h * h || r2 == 0.0f) return;
+            float r = sqrtf(r2);
+            auto gradient = rij * (KernelDerivative(r) / r);
+            acceleration -= gradient * (m * (pressureTerm + pressure[j] / (density[j] * density[j])));
+            auto vij = velocity[i] - velocity[j];
+            float projection = (vij.x * rij.x + vij.y * rij.y) / (r2 + 0.01f * h * h);
+            acceleration += gradient * (viscosity * m / density[j] * projection);
+         });
+         snapshot[i]->vel += acceleration * dt;
+      }
+   }
+
+private:
+   FluidParams params;
+   float sigma = 0.0f;
+   std::vector<float> density;
+   std::vector<float> pressure;
+   std::vector<v2d::v2d> velocity;
+};
+} // namespace Particulo
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <concepts>
+#include <math.h>
+#include <tuple>
+#include <utility>
+
+#include "v2d.hpp"
+
+namespace Particulo
+{
+// A force field maps a particle's position and velocity to an acceleration. Any callable with that signature works,
+// including lambdas; the built-in fields below cover the common cases.
+template <typename F>
+concept ForceField = std::copy_constructible<F> && requires(const F f, v2d::v2d pos, v2d::v2d vel) {
+   { f(pos, vel) } -> std::convertible_to<v2d::v2d>;
+};
+
+namespace Fields
+{
+// Constant acceleration
+struct Gravity
+{
+   v2d::v2d acceleration;
+   v2d::v2d operator()(v2d::v2d pos, v2d::v2d vel) const { return acceleration; }
+};
+// Deceleration proportional to velocity
+struct Drag
+{
+   float coefficient;
+   v2d::v2d operator()(v2d::v2d pos, v2d::v2d vel) const { return vel * -coefficient; }
+};
+// Inverse-square pull towards a point; `softening` keeps it finite near the center. Negative strength repels.
+struct Attractor
+{
+   v2d::v2d center;
+   float strength;
+   float softening = 1.0f;
+   v2d::v2d operator()(v2d::v2d pos, v2d::v2d vel) const {
+      auto delta = center - pos;
+      float d2 = delta.x * delta.x + delta.y * delta.y + softening * softening;
+      return delta * (strength / (d2 * sqrtf(d2)));
+   }
+};
+// Counter-clockwise swirl around a point, fading with squared distance
+struct Vortex
+{
+   v2d::v2d center;
+   float strength;
+   float falloff = 1.0f;
+   v2d::v2d operator()(v2d::v2d pos, v2d::v2d vel) const {
+      auto delta = pos - center;
+      float d2 = delta.x * delta.x + delta.y * delta.y + falloff * falloff;
+      return v2d::v2d(-delta.y, delta.x) * (strength / d2);
+   }
+};
+} // namespace Fields
+
+// Several fields summed into one, so they are evaluated together in a single pass over the particles
+template <ForceField... Fs>
+struct CombinedField
+{
+   std::tuple<Fs...> fields;
+   v2d::v2d operator()(v2d::v2d pos, v2d::v2d vel) const {
+      return std::apply([&](const Fs&... f) { return (v2d::v2d() + ... + f(pos, vel)); }, fields);
+   }
+};
+} // namespace Particulo
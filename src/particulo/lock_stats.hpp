@@ -0,0 +1,244 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+namespace Particulo
+{
+// Call sites that take the instance mutex
+enum class LockSite
+{
+   Simulate,
+   Update,
+   Publish,
+   Draw,
+   SwapInterval,
+   MainLoop,
+   Add,
+   Lifetime,
+   AddPrimitive,
+   Emitter,
+   ForceFields,
+   Domain,
+   Constraints,
+   Fluid,
+   Sleep,
+   Remove,
+   Handle,
+   Clear,
+   Dangerously,
+   Recording,
+   Replay,
+   Unattributed,
+   Count
+};
+
+inline const char* LockSiteName(LockSite site) {
+   static constexpr const char* names[] = {
+       "simulate",    "update",       "publish", "draw",         "swap_interval", "main_loop", "add",    "lifetime", "add_primitive",
+       "emitter",     "force_fields", "domain",  "constraints",  "fluid",         "sleep",     "remove", "handle",   "clear",
+       "dangerously", "recording",    "replay",  "unattributed",
+   };
+   return names[static_cast<int>(site)];
+}
+
+// Wait times in milliseconds
+struct LockStats
+{
+   LockSite site;
+   std::string thread;
+   uint64_t acquisitions = 0;
+   // Acquisitions that could not take the lock immediately
+   uint64_t contended = 0;
+   double totalWait = 0.0;
+   double maxWait = 0.0;
+};
+
+// Process-wide per-thread, per-site lock counters. Each thread only writes its own counters, so recording never
+// blocks on another thread.
+class LockProfiler
+{
+private:
+   struct SiteCounters
+   {
+      std::atomic<uint64_t> acquisitions = 0;
+      std::atomic<uint64_t> contended = 0;
+      std::atomic<uint64_t> waitNs = 0;
+      std::atomic<uint64_t> maxWaitNs = 0;
+   };
+   struct ThreadCounters
+   {
+      std::string name;
+      std::array<SiteCounters, static_cast<int>(LockSite::Count)> sites;
+   };
+
+public:
+   void Record(LockSite site, bool contended, uint64_t waitNs) {
+      auto& counters = local().sites[static_cast<int>(site)];
+      counters.acquisitions.fetch_add(1, std::memory_order_relaxed);
+      if (!contended) return;
+      counters.contended.fetch_add(1, std::memory_order_relaxed);
+      counters.waitNs.fetch_add(waitNs, std::memory_order_relaxed);
+      if (waitNs > counters.maxWaitNs.load(std::memory_order_relaxed)) { counters.maxWaitNs.store(waitNs, std::memory_order_relaxed); }
+   }
+   void SetThreadName(std::string name) {
+      auto& counters = local();
+      std::lock_guard lock(mtx);
+      counters.name = std::move(name);
+   }
+
+   std::vector<LockStats> Stats() {
+      std::vector<LockStats> result;
+      std::lock_guard lock(mtx);
+      for (size_t thread = 0; thread < threads.size(); thread++)
+      {
+         auto& counters = *threads[thread];
+         for (int site = 0; site < static_cast<int>(LockSite::Count); site++)
+         {
+            auto& entry = counters.sites[site];
+            auto acquisitions = entry.acquisitions.load(std::memory_order_relaxed);
+            if (acquisitions == 0) continue;
+            result.push_back({static_cast<LockSite>(site), counters.name.empty() ? "thread " + std::to_string(thread) : counters.name, acquisitions,
+                              entry.contended.load(std::memory_order_relaxed), entry.waitNs.load(std::memory_order_relaxed) / 1e6,
+                              entry.maxWaitNs.load(std::memory_order_relaxed) / 1e6});
+         }
+      }
+      return result;
+   }
+
+   void Reset() {
+      std::lock_guard lock(mtx);
+      for (auto& counters : threads)
+      {
+         for (auto& entry : counters->sites)
+         {
+            entry.acquisitions.exchange(0, std::memory_order_relaxed);
+            entry.contended.exchange(0, std::memory_order_relaxed);
+            entry.waitNs.exchange(0, std::memory_order_relaxed);
+            entry.maxWaitNs.store(0, std::memory_order_relaxed);
+         }
+      }
+   }
+
+   void Log(std::ostream& out) {
+      out << "[particulo] lock site        thread          acquired  contended   wait ms  max ms\n";
+      for (auto& stats : Stats())
+      {
+         char line[160];
+         snprintf(line, sizeof(line), "[particulo] %-16s %-14s %9llu %10llu %9.3f %7.3f\n", LockSiteName(stats.site), stats.thread.c_str(),
+                  static_cast<unsigned long long>(stats.acquisitions), static_cast<unsigned long long>(stats.contended), stats.totalWait,
+                  stats.maxWait);
+         out << line;
+      }
+      out.flush();
+   }
+
+private:
+   ThreadCounters& local() {
+      thread_local ThreadCounters* counters = nullptr;
+      if (!counters)
+      {
+         std::lock_guard lock(mtx);
+         threads.push_back(std::make_unique<ThreadCounters>());
+         counters = threads.back().get();
+      }
+      return *counters;
+   }
+
+private:
+   std::mutex mtx;
+   std::vector<std::unique_ptr<ThreadCounters>> threads;
+};
+
+inline LockProfiler& GetLockProfiler() {
+   static LockProfiler profiler;
+   return profiler;
+}
+
+// A shared_mutex that attributes acquisitions and wait time to a call site when PARTICULO_PROFILE is defined. The
+// uncontended path is a single try_lock; the clock is only read when a caller actually has to wait.
+class InstrumentedSharedMutex
+{
+public:
+   void Lock(LockSite site) {
+#ifdef PARTICULO_PROFILE
+      if (mtx.try_lock()) return GetLockProfiler().Record(site, false, 0);
+      auto start = std::chrono::steady_clock::now();
+      mtx.lock();
+      GetLockProfiler().Record(site, true, elapsed(start));
+#else
+      mtx.lock();
+#endif
+   }
+   void LockShared(LockSite site) {
+#ifdef PARTICULO_PROFILE
+      if (mtx.try_lock_shared()) return GetLockProfiler().Record(site, false, 0);
+      auto start = std::chrono::steady_clock::now();
+      mtx.lock_shared();
+      GetLockProfiler().Record(site, true, elapsed(start));
+#else
+      mtx.lock_shared();
+#endif
+   }
+
+public:
+   // SharedMutex requirements, so std::unique_lock and std::shared_lock keep working
+   void lock() { Lock(LockSite::Unattributed); }
+   bool try_lock() { return mtx.try_lock(); }
+   void unlock() { mtx.unlock(); }
+   void lock_shared() { LockShared(LockSite::Unattributed); }
+   bool try_lock_shared() { return mtx.try_lock_shared(); }
+   void unlock_shared() { mtx.unlock_shared(); }
+
+private:
+   static uint64_t elapsed(std::chrono::steady_clock::time_point start) {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+   }
+
+private:
+   std::shared_mutex mtx;
+};
+
+// Scoped exclusive or shared ownership of an InstrumentedSharedMutex attributed to a call site
+template <bool Shared>
+class SiteLock
+{
+public:
+   SiteLock(InstrumentedSharedMutex& mutex, LockSite site) : mutex(mutex), site(site) { Lock(); }
+   SiteLock(InstrumentedSharedMutex& mutex, LockSite site, std::defer_lock_t) : mutex(mutex), site(site) {}
+   SiteLock(InstrumentedSharedMutex& mutex, LockSite site, std::adopt_lock_t) : mutex(mutex), site(site), owns(true) {}
+   SiteLock(const SiteLock&) = delete;
+   SiteLock& operator=(const SiteLock&) = delete;
+   ~SiteLock() {
+      if (owns) Unlock();
+   }
+
+public:
+   void Lock() {
+      if constexpr (Shared) mutex.LockShared(site);
+      else mutex.Lock(site);
+      owns = true;
+   }
+   void Unlock() {
+      if constexpr (Shared) mutex.unlock_shared();
+      else mutex.unlock();
+      owns = false;
+   }
+
+private:
+   InstrumentedSharedMutex& mutex;
+   LockSite site;
+   bool owns = false;
+};
+using ExclusiveLock = SiteLock<false>;
+using SharedLock = SiteLock<true>;
+} // namespace Particulo
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace Particulo
+{
+// Paces a loop to a target rate with absolute deadlines, so the time spent working counts towards the period instead
+// of adding to it and the rate doesn't drift. Waiting sleeps until shortly before the deadline and spins the rest of
+// the way, since the OS may wake a sleeping thread up to a scheduler tick late.
+class FramePacer
+{
+public:
+   using Clock = std::chrono::steady_clock;
+   // The end of a wait that is spun instead of slept
+   static constexpr std::chrono::microseconds SpinMargin{1500};
+
+public:
+   // Iterations per second; zero runs as fast as possible. Can be changed from any thread.
+   void SetRate(double hz) { period = hz > 0.0 ? static_cast<int64_t>(1e9 / hz) : 0; }
+   template <typename _Rep, typename _Period>
+   void SetPeriod(std::chrono::duration<_Rep, _Period> interval) {
+      period = std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count(), 0);
+   }
+   double GetRate() const {
+      int64_t ns = period;
+      return ns > 0 ? 1e9 / ns : 0.0;
+   }
+   std::chrono::nanoseconds GetPeriod() const { return std::chrono::nanoseconds(period); }
+   // Iterations that finished after their deadline
+   uint64_t GetLate() const { return late; }
+
+   // Deadline of the next iteration; call once per iteration, from one thread, when its work is done. An iteration that
+   // overran starts a new schedule from now rather than having the following ones rush to catch up.
+   Clock::time_point Next() {
+      auto now = Clock::now();
+      std::chrono::nanoseconds step(period.load(std::memory_order_relaxed));
+      if (step.count() == 0 || deadline == Clock::time_point{}) return deadline = now;
+      deadline += step;
+      if (deadline < now)
+      {
+         late++;
+         deadline = now;
+      }
+      return deadline;
+   }
+   static void SleepUntil(Clock::time_point deadline) {
+      if (deadline - Clock::now() > SpinMargin) std::this_thread::sleep_until(deadline - SpinMargin);
+      while (Clock::now() < deadline) { std::this_thread::yield(); }
+   }
+   void Wait() { SleepUntil(Next()); }
+
+private:
+   std::atomic<int64_t> period = 0;
+   Clock::time_point deadline;
+   std::atomic<uint64_t> late = 0;
+};
+} // namespace Particulo
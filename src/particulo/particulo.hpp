@@ -13,6 +13,7 @@ using time_point = std::chrono::high_resolution_clock::time_point;
 #include <memory>
 using std::make_shared;
 using std::shared_ptr;
+using std::unique_ptr;
 
 #include <thread>
 using std::this_thread::sleep_for;
@@ -51,12 +52,48 @@ using std::shared_lock;
 using std::shared_mutex;
 using std::unique_lock;
 
+#include <atomic>
+using std::atomic;
+
+#include <barrier>
+using std::barrier;
+
+#include <array>
+
+#include <random>
+
+#include <optional>
+
+#include "arena.hpp"
+#include "capture.hpp"
+#include "collider.hpp"
+#include "constraints.hpp"
+#include "density.hpp"
+#include "domain.hpp"
+#include "emitter.hpp"
+#include "fluid.hpp"
+#include "force_field.hpp"
+#include "lock_stats.hpp"
+#include "pacing.hpp"
+#include "profiler.hpp"
+#include "replay.hpp"
 #include "shader.hpp"
+#include "slot_map.hpp"
+#include "trace.hpp"
 #include "v2d.hpp"
 #include <GLFW/glfw3.h>
 #include <Polyline2D.h>
 #include <glad/glad.h>
 #include <glm/gtc/matrix_inverse.hpp>
+#ifdef PARTICULO_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+// Times a phase for the profiler and records it on the trace timeline
+#define PARTICULO_SCOPE(phase)                                                                                                                       \
+   PARTICULO_PROFILE_SCOPE(phase);                                                                                                                   \
+   PARTICULO_TRACE_SCOPE(PhaseName(phase))
 namespace Particulo
 {
 enum CoordSpace
@@ -64,6 +101,21 @@ enum CoordSpace
    ScreenSpace,
    WorldSpace
 };
+enum class RenderMode
+{
+   // One antialiased circle per particle
+   Instances,
+   // Particles per pixel, color-mapped; for systems where particles are smaller than a pixel
+   Density
+};
+enum class Vsync
+{
+   Off,
+   On,
+   // Waits for the refresh like On, but swaps immediately when a frame misses it instead of waiting for the next one.
+   // Falls back to On where the driver lacks EXT_swap_control_tear.
+   Adaptive
+};
 // Shaders
 
 static inline const string LineVertexShader = R"(
@@ -71,7 +123,11 @@ static inline const string LineVertexShader = R"(
    precision highp float;
    layout (location = 0) in highp vec2 pPos;
    layout (location = 1) in highp vec4 pCol;
-   uniform mat4 transform;
+   layout (std140, binding = 0) uniform Frame {
+      mat4 transform;
+      vec2 viewport;
+      float time;
+   };
    out vec4 col;
    void main() {
       gl_Position = transform * vec4(pPos, 0.0, 1.0);
@@ -88,13 +144,71 @@ static inline const string LineFragmentShader = R"(
    }
 )";
 
+// Particles too small to draw as circles; shares the line fragment shader
+static inline const string PointVertexShader = R"(
+   #version 450 core
+   layout (location = 1) in highp vec4 pPos;
+   layout (location = 2) in highp vec4 pCol;
+   layout (std140, binding = 0) uniform Frame {
+      mat4 transform;
+      vec2 viewport;
+      float time;
+   };
+   out vec4 col;
+   void main() {
+      gl_Position = transform * vec4(pPos.x, pPos.y, 1.0, 1.0);
+      col = pCol;
+   }
+)";
+
+// Full-screen triangle generated from the vertex index
+static inline const string DensityVertexShader = R"(
+   #version 450 core
+   out vec2 uv;
+   void main() {
+      uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+      gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+   }
+)";
+
+// Log-scaled density through a polynomial fit of the inferno colormap; empty pixels show the background
+static inline const string DensityFragmentShader = R"(
+   #version 450 core
+   in vec2 uv;
+   out vec4 FragColor;
+   uniform sampler2D density;
+   uniform float logMax;
+
+   vec3 inferno(float t) {
+      const vec3 c0 = vec3(0.0002189403691192265, 0.001651004631001012, -0.01948089843709184);
+      const vec3 c1 = vec3(0.1065134194856116, 0.5639564367884091, 3.932712388889277);
+      const vec3 c2 = vec3(11.60249308247187, -3.972853965665698, -15.9423941062914);
+      const vec3 c3 = vec3(-41.70399613139459, 17.43639888205313, 44.35414519872813);
+      const vec3 c4 = vec3(77.162935699427, -33.40235894210092, -81.80730925738993);
+      const vec3 c5 = vec3(-71.31942824499214, 32.62606426397723, 73.20951985803202);
+      const vec3 c6 = vec3(25.13112622477341, -12.24266895238567, -23.07032500287172);
+      return c0 + t * (c1 + t * (c2 + t * (c3 + t * (c4 + t * (c5 + t * c6)))));
+   }
+
+   void main() {
+      float d = texture(density, uv).r;
+      if (d <= 0.0) discard;
+      float t = clamp(log(1.0 + d) / logMax, 0.0, 1.0);
+      FragColor = vec4(inferno(0.15 + 0.85 * t), 1.0);
+   }
+)";
+
 static inline const string ParticleVertexShader = R"(
    #version 450 core
    precision highp float;
    layout (location = 0) in highp vec3 aPos;
    layout (location = 1) in highp vec4 pPos;
    layout (location = 2) in highp vec4 pCol;
-   uniform mat4 transform;
+   layout (std140, binding = 0) uniform Frame {
+      mat4 transform;
+      vec2 viewport;
+      float time;
+   };
    out vec4 coord;
    out vec4 col;
    void main()
@@ -200,6 +314,44 @@ inline std::tuple<float, float, float, float> uint32ToFloatColor(uint32_t color)
        temp.a / 255.0f,
    };
 }
+// Per-frame data shared by the shaders through the `Frame` uniform block, in its std140 layout
+struct FrameUniforms
+{
+   static constexpr GLuint Binding = 0;
+   glm::mat4 transform;
+   glm::vec2 viewport;
+   // Seconds of simulation time
+   float time;
+   float padding = 0.0f;
+};
+
+// Axis-aligned world-space rectangle
+struct Bounds
+{
+   float minX;
+   float minY;
+   float maxX;
+   float maxY;
+   bool Overlaps(v2d::v2d pos, float radius) const {
+      return pos.x + radius >= minX && pos.x - radius <= maxX && pos.y + radius >= minY && pos.y - radius <= maxY;
+   }
+};
+// A particle as the draw thread sees it in pipelined mode
+struct ParticleInstance
+{
+   v2d::v2d pos;
+   float radius;
+   uint32_t color;
+};
+// Feeds attribute `index` of a VAO from its own binding of tightly packed floats, advancing once per instance if
+// `divisor` is 1
+inline void vertexAttribute(GLuint vao, GLuint index, GLuint buffer, int size, GLuint divisor = 0) {
+   glVertexArrayVertexBuffer(vao, index, buffer, 0, size * sizeof(GLfloat));
+   glVertexArrayAttribFormat(vao, index, size, GL_FLOAT, GL_FALSE, 0);
+   glVertexArrayAttribBinding(vao, index, index);
+   glVertexArrayBindingDivisor(vao, index, divisor);
+   glEnableVertexArrayAttrib(vao, index);
+}
 struct RGBA
 {
    float r;
@@ -211,8 +363,18 @@ struct RGBA
 class GraphicsPrimitive
 {
 public:
-   virtual void Draw() = 0;
+   // Called with the lock held; uploads whatever changed and records what Draw() needs
    virtual void UpdateBuffers() = 0;
+   // May run without the lock in pipelined mode, so it must only use what the last UpdateBuffers() recorded
+   virtual void Draw() = 0;
+   // Centerline and half-width used when the primitive is registered as a collider
+   virtual const vector<crushedpixel::Vec2>& GetPath() const = 0;
+   virtual float GetHalfWidth() const = 0;
+   // Changes whenever the path or width does, so colliders know to rebuild
+   uint64_t GetRevision() const { return revision; }
+
+protected:
+   uint64_t revision = 0;
 };
 
 class PolyLine : public GraphicsPrimitive
@@ -254,47 +416,31 @@ private:
          glCols.push_back(this->color.b);
          glCols.push_back(this->color.a);
       }
+      dirty = true;
    }
+   // The VAO is built once; drawing is a bind and a draw call
    void Init() {
-      glGenBuffers(1, &buffer);
-      glGenBuffers(1, &colorBuffer);
-      glGenVertexArrays(1, &VAO);
-      glBindVertexArray(VAO);
+      glCreateBuffers(1, &buffer);
+      glCreateBuffers(1, &colorBuffer);
+      glCreateVertexArrays(1, &VAO);
+      vertexAttribute(VAO, 0, buffer, 2);
+      vertexAttribute(VAO, 1, colorBuffer, 4);
       UpdateBuffers();
    }
 
 public:
+   // Uploads the vertices only if they changed since the last upload
    void UpdateBuffers() override {
-      glBindBuffer(GL_ARRAY_BUFFER, buffer);
-      glBufferData(GL_ARRAY_BUFFER, glVerts.size() * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-      glBufferSubData(GL_ARRAY_BUFFER, 0, glVerts.size() * sizeof(GLfloat), glVerts.data());
-
-      glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-      glBufferData(GL_ARRAY_BUFFER, glCols.size() * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-      glBufferSubData(GL_ARRAY_BUFFER, 0, glCols.size() * sizeof(GLfloat), glCols.data());
+      if (!dirty) return;
+      glNamedBufferData(buffer, glVerts.size() * sizeof(GLfloat), glVerts.data(), GL_STATIC_DRAW);
+      glNamedBufferData(colorBuffer, glCols.size() * sizeof(GLfloat), glCols.data(), GL_STATIC_DRAW);
+      drawCount = static_cast<GLsizei>(glVerts.size() / 2);
+      dirty = false;
    }
    void Draw() override {
-      glEnableVertexAttribArray(0);
-      glBindBuffer(GL_ARRAY_BUFFER, buffer);
-      glVertexAttribPointer(0, // attribute. No particular reason for 0, but must
-                               // match the layout in the shader.
-                            2,        // size
-                            GL_FLOAT, // type
-                            GL_FALSE, // normalized?
-                            0,        // stride
-                            (void*) 0 // array buffer offset
-      );
-      glEnableVertexAttribArray(1);
-      glBindBuffer(GL_ARRAY_BUFFER, colorBuffer);
-      glVertexAttribPointer(1, // attribute. No particular reason for 0, but must
-                               // match the layout in the shader.
-                            4,        // size
-                            GL_FLOAT, // type
-                            GL_FALSE, // normalized?
-                            0,        // stride
-                            (void*) 0 // array buffer offset
-      );
-      glDrawArrays(GL_TRIANGLES, 0, glVerts.size() / 2);
+      if (drawCount == 0) return;
+      glBindVertexArray(VAO);
+      glDrawArrays(GL_TRIANGLES, 0, drawCount);
    }
 
 public:
@@ -305,14 +451,17 @@ public:
    }
    void SetThickness(double thickness) {
       this->thickness = thickness;
+      revision++;
       Update();
    }
-   void SetPoints(vector<crushedpixel::Vec2> points) {
+   void SetPoints(const vector<crushedpixel::Vec2>& points) {
       this->points = points;
+      revision++;
       Update();
    }
    void SetPoints(vector<crushedpixel::Vec2>&& points) {
-      this->points = points;
+      this->points = std::move(points);
+      revision++;
       Update();
    }
 
@@ -321,6 +470,8 @@ public:
    const int GetIndex() const { return index; }
    const double GetThickness() const { return thickness; }
    const vector<crushedpixel::Vec2>& GetPoints() const { return points; }
+   const vector<crushedpixel::Vec2>& GetPath() const override { return points; }
+   float GetHalfWidth() const override { return thickness / 2.0; }
 
 private:
    int index;
@@ -330,17 +481,19 @@ private:
    vector<GLfloat> glVerts;
    vector<GLfloat> glCols;
    RGBA color;
-   GLuint buffer;
-   GLuint colorBuffer;
-   GLuint VAO;
+   GLuint buffer = 0;
+   GLuint colorBuffer = 0;
+   GLuint VAO = 0;
+   // Vertices in the buffers as of the last upload, which can lag glVerts until the next UpdateBuffers()
+   GLsizei drawCount = 0;
+   bool dirty = true;
 };
 class Bezier : public GraphicsPrimitive
 {
 public:
    Bezier(int index, vector<v2d::v2d> controlPoints, double thickness, uint32_t color)
-       : index(index), controlPoints(std::move(controlPoints)), color(color), thickness(thickness) {
-      Update();
-   }
+       : index(index), color(color), thickness(thickness), controlPoints(std::move(controlPoints)),
+         polyLine(index, curve(), thickness, color) {}
 
 public:
    const vector<v2d::v2d>& GetControlPoints() const { return controlPoints; }
@@ -358,15 +511,23 @@ public:
    }
    void SetThickness(double thickness) {
       this->thickness = thickness;
-      Update();
+      polyLine.SetThickness(thickness);
+      revision++;
    }
 
 public:
    void Draw() override { polyLine.Draw(); }
    void UpdateBuffers() override { polyLine.UpdateBuffers(); }
+   const vector<crushedpixel::Vec2>& GetPath() const override { return polyLine.GetPoints(); }
+   float GetHalfWidth() const override { return thickness / 2.0; }
 
 private:
+   // Updated in place rather than replaced, so the buffers and draw count only change in UpdateBuffers()
    void Update() {
+      polyLine.SetPoints(curve());
+      revision++;
+   }
+   vector<crushedpixel::Vec2> curve() const {
       vector<crushedpixel::Vec2> points;
       for (int j = 0; j < this->controlPoints.size(); j += 4)
       {
@@ -382,7 +543,7 @@ private:
             points.push_back({xu, yu});
          }
       }
-      polyLine = PolyLine(index, std::move(points), thickness, color);
+      return points;
    }
    void UpdateColor() { polyLine.SetColor(color); }
 
@@ -440,6 +601,8 @@ protected:
    const float GetWidth() const { return p_width; }
    const float GetHeight() const { return p_height; }
    const float GetMaxCount() const { return p_maxCount; }
+   // Times the particle arena ran out of its slab and fell back to the heap; should stay 0
+   size_t GetArenaOverflowCount() const { return arena->GetOverflowCount(); }
    const time_point& GetInitialTime() const { return p_initialTime; }
    const std::tuple<double, double> GetMousePos(CoordSpace coordSpace = ScreenSpace) const {
       double x, y;
@@ -464,21 +627,159 @@ protected:
    void SetTransform(glm::mat4 transform) { p_transform = transform; }
    template <typename... _Args>
    shared_ptr<T> Add(_Args&&... __args) {
-      unique_lock lock(mtx);
-      if (particles.size() == p_maxCount)
+      ExclusiveLock lock(mtx, LockSite::Add);
+      if (particles.size() + spawnSlots.size() >= static_cast<size_t>(p_maxCount))
       {
          throw std::logic_error("Attempted to exceed the max particle count in instance method "
                                 "Add(_Args&&... __args)");
       }
-      auto particle = make_shared<T>(++maxParticleIndex, __args...);
-      particles.push_back(particle);
-      snapshot = particles;
+      auto particle = allocateParticle(__args...);
+      particles.Insert(particle);
       return particle;
    }
-   shared_ptr<PolyLine> AddPolyLine(vector<crushedpixel::Vec2>&& points, uint32_t color, double thickness) {
-      unique_lock lock(mtx);
+   // Adds a particle that is removed automatically once `lifetime` seconds of simulation have passed. Its slot and
+   // memory are reused by later particles.
+   template <typename... _Args>
+   shared_ptr<T> AddTransient(float lifetime, _Args&&... __args) {
+      ExclusiveLock lock(mtx, LockSite::Add);
+      if (particles.size() + spawnSlots.size() >= static_cast<size_t>(p_maxCount))
+      {
+         throw std::logic_error("Attempted to exceed the max particle count in instance method "
+                                "AddTransient(float lifetime, _Args&&... __args)");
+      }
+      auto particle = allocateParticle(__args...);
+      particles.Insert(particle, lifetime);
+      lifetimes = true;
+      return particle;
+   }
+   // Sets the remaining lifetime of a particle in seconds; returns false if it was already removed
+   bool SetLifetime(ParticleHandle handle, float lifetime) {
+      ExclusiveLock lock(mtx, LockSite::Lifetime);
+      lifetimes = true;
+      return particles.SetLifetime(handle, lifetime);
+   }
+   // Emitters may be changed while the simulation runs; changes apply from the next step
+   shared_ptr<Emitter> AddEmitter(Emitter emitter) {
+      ExclusiveLock lock(mtx, LockSite::Emitter);
+      auto added = make_shared<Emitter>(emitter);
+      emitters.push_back({added, 0.0f});
+      return added;
+   }
+   void RemoveEmitter(const shared_ptr<Emitter>& emitter) {
+      ExclusiveLock lock(mtx, LockSite::Emitter);
+      std::erase_if(emitters, [&](const EmitterState& state) { return state.emitter == emitter; });
+   }
+   // Replaces the force fields. Every step, before simulate(), each worker adds the sum of all fields to the velocity of
+   // the particles in its section in a single pass. Fields are accelerations per second squared, integrated over the
+   // step's duration; call with no fields to remove them.
+   template <ForceField... Fs>
+   void SetForceFields(Fs... fields) requires(BasicParticleV<T> && requires(T a) {
+      { a.vel } -> same_as<v2d::v2d&>;
+   }) {
+      ExclusiveLock lock(mtx, LockSite::ForceFields);
+      particles.WakeAll();
+      if constexpr (sizeof...(Fs) == 0) { forcePass = nullptr; }
+      else
+      {
+         forcePass = [field = CombinedField<Fs...>{{fields...}}](span<shared_ptr<T>> section, float dt) {
+            for (auto& p : section) { p->vel += field(p->pos, p->vel) * dt; }
+         };
+      }
+   }
+   // Enforces the domain's boundaries on every particle after simulate(). Absorbed particles are removed at the end of
+   // the step.
+   void SetDomain(Domain domain) {
+      ExclusiveLock lock(mtx, LockSite::Domain);
+      this->domain = domain;
+      particles.WakeAll();
+      if (domain.Absorbs()) lifetimes = true;
+      if (grid.Enabled()) configureGrid();
+   }
+   // Maintains a uniform grid of the snapshot for neighbour queries with GetGrid(); 0 disables it. The grid covers the
+   // domain, or the window if no domain bounds were set.
+   void SetGridCellSize(float cellSize) {
+      ExclusiveLock lock(mtx, LockSite::Domain);
+      gridCellSize = cellSize;
+      if (cellSize > 0.0f) configureGrid();
+      else grid.Disable();
+   }
+   const Domain& GetDomain() const { return domain; }
+   // Indexes the snapshot passed to simulate(); valid for the duration of the step
+   const SpatialGrid& GetGrid() const { return grid; }
+   // Links two particles at their current distance. Compliance is the inverse stiffness (0 is rigid). Constraints are
+   // solved with XPBD after simulate() and take effect from the next step; returns false if a particle was removed.
+   bool AddDistanceConstraint(ParticleHandle a, ParticleHandle b, float compliance = 0.0f) {
+      ExclusiveLock lock(mtx, LockSite::Constraints);
+      auto pa = particles.Find(a);
+      auto pb = particles.Find(b);
+      if (!pa || !pb) return false;
+      pendingConstraints.AddDistance(a, b, sqrtf(pa->pos.sqrDist(pb->pos)), compliance);
+      return true;
+   }
+   // Resists bending at b by keeping a and c at their current distance
+   bool AddBendConstraint(ParticleHandle a, ParticleHandle b, ParticleHandle c, float compliance = 0.0f) {
+      ExclusiveLock lock(mtx, LockSite::Constraints);
+      auto pa = particles.Find(a);
+      auto pc = particles.Find(c);
+      if (!pa || !particles.Contains(b) || !pc) return false;
+      pendingConstraints.AddBend(a, b, c, sqrtf(pa->pos.sqrDist(pc->pos)), compliance);
+      return true;
+   }
+   void ClearConstraints() {
+      ExclusiveLock lock(mtx, LockSite::Constraints);
+      pendingConstraints.Clear();
+      clearConstraints = true;
+   }
+   // Solver iterations per step; more iterations make stiff constraints converge
+   void SetConstraintIterations(int iterations) { constraintIterations = iterations; }
+   // Color of the lines drawn for constraints; 0 hides them
+   void SetConstraintColor(uint32_t color) { constraintColor = color; }
+   // Simulates the particles as an SPH fluid: before simulate(), pressure and viscosity accelerations times the step's
+   // duration are added to every particle's velocity, so simulate() only has to integrate positions. Neighbours come
+   // from the spatial grid, whose cells are widened to the smoothing length if needed. Takes effect from the next step.
+   void EnableFluid(FluidParams params) requires(BasicParticleV<T> && requires(T a) {
+      { a.vel } -> same_as<v2d::v2d&>;
+   }) {
+      ExclusiveLock lock(mtx, LockSite::Fluid);
+      fluidParams = params;
+      fluidRequested = true;
+   }
+   void DisableFluid() {
+      ExclusiveLock lock(mtx, LockSite::Fluid);
+      fluidRequested = false;
+   }
+   // Density of snapshot[index] as of the current step
+   float GetFluidDensity(size_t index) const { return fluid.Density(index); }
+   // Particles slower than `speed` for `steps` consecutive steps fall asleep: they are left out of simulate(), force
+   // fields, collisions and boundaries until woken, so a step costs in proportion to the awake particles. Speed is
+   // compared against `vel`, or the displacement over a step for Verlet particles. With the spatial grid enabled, a
+   // moving particle wakes the sleeping ones within twice its radius; otherwise call Wake() on contact. Changing the
+   // force fields, colliders or domain wakes everything. A speed of 0 disables sleeping.
+   void SetSleeping(float speed, int steps) {
+      ExclusiveLock lock(mtx, LockSite::Sleep);
+      sleepSpeed = speed;
+      sleepSteps = static_cast<uint16_t>(std::clamp(steps, 1, 0xffff));
+      if (speed <= 0.0f) particles.WakeAll();
+   }
+   // Wakes a sleeping particle at the end of the step; safe to call from simulate()
+   void Wake(const T& particle) {
+      std::lock_guard lock(wakeMutex);
+      wakeRequests.push_back(particles.HandleOf(particle));
+   }
+   void WakeAll() {
+      ExclusiveLock lock(mtx, LockSite::Sleep);
+      particles.WakeAll();
+   }
+   // Ages particles by a fixed amount per step instead of the measured step duration; 0 restores the default
+   void SetFixedTimestep(float seconds) { fixedTimestep = seconds; }
+   // Duration of the previous step in seconds, the amount particles were aged by this step
+   float GetStepDelta() const { return stepDelta; }
+   // A collider also blocks particles; see SetCollider()
+   shared_ptr<PolyLine> AddPolyLine(vector<crushedpixel::Vec2>&& points, uint32_t color, double thickness, bool collider = false) {
+      ExclusiveLock lock(mtx, LockSite::AddPrimitive);
       auto line = make_shared<PolyLine>(++maxParticleIndex, std::move(points), thickness, color);
       primitives.push_back(line);
+      if (collider) setCollider(line, true);
       return line;
    }
 
@@ -501,51 +802,81 @@ protected:
    //    return result;
    // }
 
-   shared_ptr<Bezier> AddBezier(vector<v2d::v2d> controlPoints, uint32_t color, double thickness) {
-      unique_lock lock(mtx);
+   shared_ptr<Bezier> AddBezier(vector<v2d::v2d> controlPoints, uint32_t color, double thickness, bool collider = false) {
+      ExclusiveLock lock(mtx, LockSite::AddPrimitive);
       auto bezier = make_shared<Bezier>(++maxParticleIndex, std::move(controlPoints), thickness, color);
       primitives.push_back(bezier);
+      if (collider) setCollider(bezier, true);
       return bezier;
    }
+   // Registers a primitive as static geometry that particles with a v2d pos collide with after simulate(). Its segments
+   // go into a BVH that is rebuilt at the end of the step whenever a collider's points or thickness change.
+   void SetCollider(const shared_ptr<GraphicsPrimitive>& primitive, bool collider) {
+      ExclusiveLock lock(mtx, LockSite::AddPrimitive);
+      setCollider(primitive, collider);
+   }
+   // Fraction of the normal velocity kept when bouncing off a collider
+   void SetColliderRestitution(float restitution) { this->restitution = restitution; }
+   // Creates a particle without adding it; pass it to Swap() or DangerouslySet(). Call while holding the particles,
+   // i.e. between DangerouslyGet() and DangerouslySet().
    template <typename... _Args>
    shared_ptr<T> NewParticle(_Args&&... __args) {
-      return make_shared<T>(++maxParticleIndex, __args...);
+      return allocateParticle(__args...);
    }
    void Swap(vector<shared_ptr<T>>&& newParticles) {
-      if (newParticles.size() > p_maxCount)
+      if (newParticles.size() + spawnSlots.size() > static_cast<size_t>(p_maxCount))
       {
          throw std::logic_error("Attempted to exceed the max particle count in instance method "
                                 "Add(_Args&&... __args)");
       }
-      particles = newParticles;
-      snapshot = particles;
+      particles.Assign(std::move(newParticles));
+      takeSnapshot();
    }
    void DangerouslySet(vector<shared_ptr<T>>&& newParticles) {
-      if (newParticles.size() > p_maxCount)
-      {
-         throw std::logic_error("Attempted to exceed the max particle count in instance method "
-                                "Add(_Args&&... __args)");
-      }
-      particles = newParticles;
-      snapshot = particles;
-      mtx.unlock();
+      ExclusiveLock lock(mtx, LockSite::Dangerously, std::adopt_lock);
+      Swap(std::move(newParticles));
    }
-   vector<shared_ptr<T>>&& DangerouslyGet() {
-      mtx.lock();
-      return std::move(particles);
+   // Returns a copy, so the slot map's other columns stay consistent until DangerouslySet() hands the particles back
+   vector<shared_ptr<T>> DangerouslyGet() {
+      mtx.Lock(LockSite::Dangerously);
+      return particles.Dense();
    }
+   // Removes the last particle
    void Remove() {
-      unique_lock lock(mtx);
-      particles.pop_back();
+      ExclusiveLock lock(mtx, LockSite::Remove);
+      if (particles.size() != 0) particles.Erase(particles.size() - 1);
    }
+   // Removes the particle at position i; the last awake or sleeping particle takes its place
    void Remove(int i) {
-      unique_lock lock(mtx);
-      particles.erase(particles.front() + i);
+      ExclusiveLock lock(mtx, LockSite::Remove);
+      if (i < 0 || static_cast<size_t>(i) >= particles.size())
+      { throw std::logic_error("Attempted to remove a particle out of range in instance method Remove(int i)"); }
+      particles.Erase(static_cast<size_t>(i));
+   }
+   // Removes a particle by handle; returns false if it was already removed
+   bool Remove(ParticleHandle handle) {
+      ExclusiveLock lock(mtx, LockSite::Remove);
+      return particles.Erase(handle);
+   }
+   // Handles stay valid until their particle is removed, regardless of how the particles are reordered. GetHandle() and
+   // Get() take the lock, so call them from event handlers or init() rather than from simulate() or update().
+   ParticleHandle GetHandle(const T& particle) const {
+      SharedLock lock(mtx, LockSite::Handle);
+      return particles.HandleOf(particle);
+   }
+   // The particle behind a handle, or nullptr once it has been removed
+   shared_ptr<T> Get(ParticleHandle handle) const {
+      SharedLock lock(mtx, LockSite::Handle);
+      return particles.Get(handle);
    }
    void Clear() {
-      unique_lock lock(mtx);
+      ExclusiveLock lock(mtx, LockSite::Clear);
       cout << "Removing " << particles.size() << " particles" << endl;
-      particles.clear();
+      particles.Clear();
+      snapshot.clear();
+      grid.Clear();
+      // Everything goes back to the slab at once unless a particle is still referenced elsewhere
+      arena->Reset();
       std::fill(particle_position_size_data.begin(), particle_position_size_data.end(), 0);
       std::fill(particle_color_data.begin(), particle_color_data.end(), 0);
    }
@@ -560,38 +891,222 @@ private:
    bool p_fullscreen = false;
 
 private:
-   GLuint VAO;
+   // Billboard quads instanced per particle
+   GLuint particleVAO;
+   // The same position and color buffers read once per vertex, for particles drawn as points
+   GLuint pointVAO;
    Shader particleShader;
    Shader lineShader;
+   Shader pointShader;
+   Shader densityShader;
+   UniformBuffer<FrameUniforms> frameUniforms;
+   GLuint densityVAO;
+   GLuint densityTexture;
+   int densityTextureWidth = 0;
+   int densityTextureHeight = 0;
    GLuint particles_position_buffer;
    GLuint particles_color_buffer;
    GLuint billboard_vertex_buffer;
    vector<GLfloat> particle_position_size_data;
    vector<GLfloat> particle_color_data;
+   int instanceCount = 0;
+   // Sub-pixel particles drawn as points, packed at the end of the instance arrays
+   int pointCount = 0;
+   atomic<float> pointThreshold = 1.0f;
+
+private:
+   TrajectoryRecorder recorder;
+   vector<GLfloat> record_position_size_data;
+   vector<GLfloat> record_color_data;
+   TrajectoryPlayer player;
+   atomic<bool> replaying = false;
+   atomic<int64_t> replaySeek = -1;
+   atomic<double> replaySpeed = 1.0;
+   uint64_t replayStep = 0;
+   double replayTime = 0.0;
+   time_point lastFrameTime;
+
+private:
+   milliseconds profileLogInterval = milliseconds(0);
+   milliseconds lastProfileLog = milliseconds(0);
+   string traceFile;
 
 private:
    vector<shared_ptr<GraphicsPrimitive>> primitives;
+   // The primitives as of the frame's setup, so lines can be drawn after the lock is released
+   vector<shared_ptr<GraphicsPrimitive>> framePrimitives;
+
+private:
+   // One completed step, as much of it as the draw thread needs
+   struct FrameState
+   {
+      vector<ParticleInstance> particles;
+      vector<GLfloat> constraintVertices;
+   };
+   atomic<bool> pipelined = false;
+   // What prepareFrame() saw of the settings for the frame being drawn; the rest of the frame may run without the lock
+   bool framePipelined = false;
+   bool frameDensity = false;
+   bool frameReplaying = false;
+   int frameWidth = 0;
+   int frameHeight = 0;
+   // Triple buffered: the step completion fills backState and swaps it with readyState, and the draw thread swaps
+   // readyState with frontState when a newer step is there, so neither side ever waits for the other
+   FrameState frameStates[3];
+   FrameState* backState = &frameStates[0];
+   FrameState* readyState = &frameStates[1];
+   FrameState* frontState = &frameStates[2];
+   bool stateReady = false;
+   std::mutex stateMutex;
 
 private:
-   vector<shared_ptr<T>> particles;
+   // Declared before the particles so it outlives them; particles share it too, so it also outlives the instance as
+   // long as any particle is still referenced
+   shared_ptr<ParticleArena> arena = make_shared<ParticleArena>();
+   SlotMap<T> particles;
    vector<shared_ptr<T>> snapshot;
-   GLFWwindow* window;
+   // Null when rendering offscreen
+   GLFWwindow* window = nullptr;
    bool isReady;
-   milliseconds timeElapsed;
+   milliseconds timeElapsed = milliseconds(0);
+   time_point lastStepTime;
+   float stepDelta = 0.0f;
+   atomic<float> fixedTimestep = 0.0f;
+   bool lifetimes = false;
+   // Dense positions of the particles each worker found expired in its awake and sleeping sections, in order, and the
+   // revision of the particles it aged
+   std::array<vector<uint32_t>, threadCount> expiredAwake;
+   std::array<vector<uint32_t>, threadCount> expiredAsleep;
+   std::array<uint64_t, threadCount> expiredRevision{};
+   vector<uint32_t> erasedAwake;
+   vector<uint32_t> erasedAsleep;
+
+private:
+   struct EmitterState
+   {
+      shared_ptr<Emitter> emitter;
+      // Particles owed from previous steps: a fraction, or a backlog while the max count was reached
+      float carry;
+   };
+   // Spawns of one emitter; `end` is one past its last entry in spawnSlots
+   struct SpawnBatch
+   {
+      Emitter emitter;
+      size_t end;
+   };
+   vector<EmitterState> emitters;
+   vector<SpawnBatch> spawnBatches;
+   vector<uint32_t> spawnSlots;
+   vector<shared_ptr<T>> spawned;
+   std::array<std::minstd_rand, threadCount> spawnRandom;
+   function<void(span<shared_ptr<T>>, float)> forcePass;
+   Domain domain;
+   SpatialGrid grid;
+   float gridCellSize = 0.0f;
+   vector<std::pair<shared_ptr<GraphicsPrimitive>, uint64_t>> colliders;
+   SegmentBVH colliderBVH;
+   atomic<float> restitution = 1.0f;
+
+private:
+   // The active constraints only change when a step completes, so every worker sees the same colors and waits on the
+   // constraint barrier the same number of times
+   ConstraintSet constraints;
+   ConstraintSet pendingConstraints;
+   bool clearConstraints = false;
+   uint64_t constraintsPrunedAt = 0;
+   atomic<int> constraintIterations = 4;
+   int solverIterations = 0;
+   bool solving = false;
+   // Separates the phases of a step that need every worker's results: constraint colors and the SPH passes
+   std::optional<barrier<>> phaseBarrier{std::in_place, threadCount};
+   atomic<uint32_t> constraintColor = 0xffffff80;
+   GLuint constraintBuffer = 0;
+   // Color attribute left disabled, so it reads the current value set before each draw
+   GLuint constraintVAO = 0;
+   vector<GLfloat> constraintVertices;
+
+private:
+   float sleepSpeed = 0.0f;
+   uint16_t sleepSteps = 1;
+   // Awake particles as of the snapshot; snapshot positions past it are asleep
+   size_t snapshotActive = 0;
+   // Bound on how far particles move from their place in the grid before it is rebuilt, for culling
+   float gridDrift = INFINITY;
+   std::array<vector<ParticleHandle>, threadCount> drowsy;
+   std::array<vector<ParticleHandle>, threadCount> woken;
+   mutex wakeMutex;
+   vector<ParticleHandle> wakeRequests;
+
+private:
+   Fluid fluid;
+   FluidParams fluidParams;
+   bool fluidRequested = false;
+   // Like `solving`, only changes when a step completes
+   bool fluidActive = false;
    RGBA bgColor = {0.0f, 0.0f, 0.0f, 1.0f};
    mutable int maxParticleIndex;
    glm::mat4 screenCorrectionTransform = glm::mat4(1.0f);
    glm::mat4 identity = glm::mat4(1.0f);
    glm::mat4 tempMatrix = glm::mat4(1.0f);
-   bool isClosing = false;
+   atomic<bool> culling = true;
+   atomic<RenderMode> renderMode = RenderMode::Instances;
+
+private:
+   struct CaptureRequest
+   {
+      string path;
+      FrameFormat format;
+      // Frames to capture; -1 captures until stopped and 0 stops
+      int frames;
+      // Whether a PPM path is a pattern taking the frame index, or the literal name of a screenshot
+      bool sequence;
+   };
+   // Frames waiting to be encoded before new ones are dropped
+   static constexpr size_t MaxCaptureBacklog = 8;
+   std::mutex captureMutex;
+   std::optional<CaptureRequest> captureRequest;
+   unique_ptr<FrameWriter> captureWriter;
+   unique_ptr<PixelReadback> captureReadback;
+   int captureFramesLeft = 0;
+   uint64_t captureIndex = 0;
+   atomic<uint64_t> droppedFrames = 0;
+
+private:
+   DensityMap densityMap;
+   unique_ptr<WorkerPool> densityPool;
+   atomic<bool> isClosing = false;
    int wPosX, wPosY;
+#ifdef PARTICULO_EGL
+   EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+   EGLContext eglContext = EGL_NO_CONTEXT;
+   EGLSurface eglSurface = EGL_NO_SURFACE;
+   GLuint offscreenFramebuffer = 0;
+   GLuint offscreenColor = 0;
+#endif
    int wSizeX, wSizeY;
 
 private:
    vector<thread> simThreads;
+   // Workers for RunHeadless(), kept between calls
+   unique_ptr<WorkerPool> headlessPool;
    thread drawThread;
-   mutable shared_mutex mtx;
-   bool swapInterval = false;
+   mutable InstrumentedSharedMutex mtx;
+
+private:
+   struct StepCompletion
+   {
+      Particulo* instance;
+      void operator()() noexcept { instance->completeStep(); }
+   };
+   // Workers leaving Start() drop out of both barriers, so joinThreads() builds new ones for the next run
+   std::optional<barrier<StepCompletion>> stepBarrier{std::in_place, threadCount, StepCompletion{this}};
+   // Set when the swap interval needs to be applied again on the draw thread
+   atomic<bool> swapInterval = false;
+   atomic<Vsync> vsync = Vsync::Adaptive;
+   FramePacer framePacer;
+   FramePacer stepPacer;
+   // Set by the step completion, so every worker waits for the same deadline
+   FramePacer::Clock::time_point stepDeadline;
 
 public:
    virtual void init() {}
@@ -599,7 +1114,18 @@ public:
    // timeElapsed, int thread) = 0;
    virtual void simulate(const vector<shared_ptr<T>>& snapshot, const span<shared_ptr<T>> section, milliseconds timeElapsed) = 0;
    virtual void update(const vector<shared_ptr<T>>& particles, milliseconds timeElapsed){};
-   virtual ~Particulo(){};
+   virtual ~Particulo() {
+#ifdef PARTICULO_EGL
+      if (eglDisplay != EGL_NO_DISPLAY)
+      {
+         finishCapture();
+         eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+         if (eglContext != EGL_NO_CONTEXT) eglDestroyContext(eglDisplay, eglContext);
+         if (eglSurface != EGL_NO_SURFACE) eglDestroySurface(eglDisplay, eglSurface);
+         eglTerminate(eglDisplay);
+      }
+#endif
+   };
 
 protected:
    void SetBGColor(float r, float g, float b, float a = 1.0f) { bgColor = {r, g, b, a}; }
@@ -613,6 +1139,34 @@ protected:
           a,
       };
    }
+   // Particles outside the view are skipped before upload; on by default. With the spatial grid enabled, zoomed-in
+   // views only visit the grid cells on screen.
+   void SetCulling(bool enabled) { culling = enabled; }
+   // Density mode counts particles per pixel on the CPU, spread over `threadCount` splat workers, and color-maps the
+   // counts in one full-screen pass, so a frame costs in proportion to the window size rather than the particle count.
+   // Replays always draw instances.
+   void SetRenderMode(RenderMode mode) { renderMode = mode; }
+   // Particles with an on-screen radius below `pixels` are drawn as single points instead of circles, with their alpha
+   // scaled by the area they would cover. 0 always draws circles.
+   void SetPointThreshold(float pixels) { pointThreshold = pixels; }
+   // Frames drawn per second, 0 for as many as vsync allows; Start() sets it from its draw interval
+   void SetTargetFPS(double fps) { framePacer.SetRate(fps); }
+   // Simulation steps per second, 0 for as many as the workers can run; Start() sets it from its sim interval
+   void SetTargetStepRate(double hz) { stepPacer.SetRate(hz); }
+   double GetTargetFPS() const { return framePacer.GetRate(); }
+   double GetTargetStepRate() const { return stepPacer.GetRate(); }
+   // Frames and steps that finished after their deadline
+   uint64_t GetLateFrames() const { return framePacer.GetLate(); }
+   uint64_t GetLateSteps() const { return stepPacer.GetLate(); }
+   void SetVsync(Vsync mode) {
+      vsync = mode;
+      swapInterval = true;
+   }
+   // Pipelined mode draws the last completed step while the workers run the next. The step completion publishes the
+   // particles and constraints it leaves behind, and the draw thread only holds the lock long enough to set up the
+   // frame, so packing, upload and drawing overlap simulation instead of waiting for it. Frames show the simulation one
+   // step late, and particles are culled without the spatial grid.
+   void SetPipelined(bool pipelined) { this->pipelined = pipelined; }
    void DisableCursor() {
       if (!isReady) { throw std::logic_error("Cannot disable cursor before initialization"); }
       glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -700,116 +1254,698 @@ public:
    void Create(int width, int height, string title = "Particulo") {
       static_assert(initialCount < maxCount, "Attempted to exceed the max particle count during creation");
       p_initialTime = high_resolution_clock::now();
+      lastStepTime = p_initialTime;
       p_maxCount = maxCount;
       p_title = title;
-      for (int i = 0; i < initialCount; i++) { particles.push_back(make_shared<T>(i)); }
+      reserveParticles();
+      for (int i = 0; i < initialCount; i++) { particles.Insert(allocateParticle()); }
       maxParticleIndex = initialCount - 1;
       gfxInit(width, height);
       bufferInit();
       init();
-      snapshot = particles;
+      takeSnapshot();
       glfwMakeContextCurrent(NULL);
       isReady = true;
    }
-   template <typename _DrawRep, typename _DrawPeriod, typename _SimRep, typename _SimPeriod>
-   void Start(duration<_DrawRep, _DrawPeriod> drawSleepInterval, duration<_SimRep, _SimPeriod> simSleepInterval, function<bool()> haltingCondition) {
-      startThreads(simSleepInterval, haltingCondition);
-      startDrawThread(drawSleepInterval, haltingCondition);
-      while (!haltingCondition() && !isClosing) { mainThreadLoop(drawSleepInterval); }
+   // Creates the simulation without a window or GL context; drive it with RunHeadless()
+   template <int maxCount = 1 << 14, int initialCount = 0>
+   void CreateHeadless(int width, int height, string title = "Particulo") {
+      static_assert(initialCount < maxCount, "Attempted to exceed the max particle count during creation");
+      p_initialTime = high_resolution_clock::now();
+      lastStepTime = p_initialTime;
+      p_maxCount = maxCount;
+      p_title = title;
+      p_width = width;
+      p_height = height;
+      reserveParticles();
+      for (int i = 0; i < initialCount; i++) { particles.Insert(allocateParticle()); }
+      maxParticleIndex = initialCount - 1;
+      init();
+      takeSnapshot();
    }
+#ifdef PARTICULO_EGL
+   // Creates the simulation with an offscreen GL context instead of a window, for rendering on machines without a
+   // display, e.g. EGL on Mesa's llvmpipe. Drive it with RenderOffscreen().
+   template <int maxCount = 1 << 14, int initialCount = 0>
+   void CreateOffscreen(int width, int height, string title = "Particulo") {
+      static_assert(initialCount < maxCount, "Attempted to exceed the max particle count during creation");
+      p_initialTime = high_resolution_clock::now();
+      lastStepTime = p_initialTime;
+      p_maxCount = maxCount;
+      p_title = title;
+      reserveParticles();
+      for (int i = 0; i < initialCount; i++) { particles.Insert(allocateParticle()); }
+      maxParticleIndex = initialCount - 1;
+      eglInit(width, height);
+      bufferInit();
+      init();
+      takeSnapshot();
+   }
+   // Renders `frames` frames, running `stepsPerFrame` simulation steps before each, and writes them to `path`. Frames
+   // are read back through a ring of pixel buffers and encoded on a writer thread, so drawing never waits for the
+   // readback of the frame it just drew or for file output.
+   void RenderOffscreen(int frames, int stepsPerFrame, const string& path, FrameFormat format = FrameFormat::PPM) {
+      FrameWriter writer(path, format);
+      PixelReadback readback;
+      readback.Resize(p_width, p_height);
+      CapturedFrame frame;
+      for (int i = 0; i < frames; i++)
+      {
+         RunHeadless(stepsPerFrame);
+         commonDraw();
+         if (readback.Queue(i, frame)) writer.Write(std::move(frame));
+         while (readback.Collect(frame)) { writer.Write(std::move(frame)); }
+      }
+      while (readback.Pending() > 0)
+      {
+         if (readback.Collect(frame, true)) writer.Write(std::move(frame));
+      }
+      writer.Close();
+      if (readback.Dropped() > 0) throw std::runtime_error("Unable to read back " + std::to_string(readback.Dropped()) + " frames");
+      if (writer.Failures() > 0) throw std::runtime_error("Unable to write " + std::to_string(writer.Failures()) + " frames to " + path);
+   }
+#endif
+   // Runs exactly `steps` simulation steps and returns when they are done. The calling thread is worker 0; the others
+   // are started on the first call and kept, so rendering a frame every few steps doesn't start a thread per frame.
+   void RunHeadless(int steps) {
+      if (steps <= 0) return;
+      if (!headlessPool)
+      { headlessPool = std::make_unique<WorkerPool>(threadCount, [this](int worker) { nameThread("worker " + std::to_string(worker)); }); }
+      headlessPool->Run([&](int worker) {
+         for (int s = 0; s < steps; s++) { step(worker); }
+      });
+   }
+   // Records every simulation step to a trajectory file until StopRecording() is called. Steps are written on a
+   // background thread; StopRecording() waits for them and throws if any could not be written.
+   void StartRecording(const string& path) {
+      ExclusiveLock lock(mtx, LockSite::Recording);
+      record_position_size_data.resize(p_maxCount * 4);
+      record_color_data.resize(p_maxCount * 4);
+      recorder.Open(path, p_maxCount);
+   }
+   void StopRecording() {
+      ExclusiveLock lock(mtx, LockSite::Recording);
+      if (!recorder.IsOpen()) return;
+      recorder.Close();
+      if (recorder.Failed()) throw std::runtime_error("Unable to write the whole trajectory");
+   }
+   // Plays back a recorded trajectory instead of running simulate/update
+   void Replay(const string& path) {
+      ExclusiveLock lock(mtx, LockSite::Replay);
+      // Opening closes any trajectory already playing, even if the new one turns out to be invalid
+      replaying = false;
+      player.Open(path);
+      if (player.GetMaxCount() > static_cast<uint32_t>(p_maxCount))
+      {
+         player.Close();
+         throw std::logic_error("Attempted to replay a trajectory recorded with a larger max particle count");
+      }
+      if (player.GetStepCount() == 0)
+      {
+         player.Close();
+         throw std::logic_error("Attempted to replay an empty trajectory");
+      }
+      replayStep = 0;
+      replayTime = 0.0;
+      replaySeek = 0;
+      lastFrameTime = high_resolution_clock::now();
+      replaying = true;
+   }
+   void StopReplay() {
+      ExclusiveLock lock(mtx, LockSite::Replay);
+      replaying = false;
+      player.Close();
+   }
+   // Jumps to a recorded step; takes effect on the next drawn frame
+   void SeekReplay(uint64_t step) { replaySeek = static_cast<int64_t>(step); }
+   // Playback rate relative to the recording, e.g. 4.0 plays four times faster than real time and 0.0 pauses
+   void SetReplaySpeed(double speed) { replaySpeed = speed; }
+   const uint64_t GetReplayStep() const { return replayStep; }
+   const uint64_t GetReplayStepCount() const { return player.GetStepCount(); }
+   const bool IsReplaying() const { return replaying; }
+
+   // Per-phase timings since the last profile log or ResetProfile(). Only collected when built with PARTICULO_PROFILE.
+   PhaseStats GetPhaseStats(Phase phase) const { return GetProfiler().Stats(phase); }
+   // Acquisitions and wait times of the instance mutex per call site and thread. Only collected with PARTICULO_PROFILE.
+   vector<LockStats> GetLockStats() const { return GetLockProfiler().Stats(); }
+   void ResetProfile() {
+      GetProfiler().Reset();
+      GetLockProfiler().Reset();
+   }
+   // Prints per-phase timings and lock statistics to stdout at the given interval and starts a new window; zero disables the log
+   template <typename _Rep, typename _Period>
+   void SetProfileLogInterval(duration<_Rep, _Period> interval) { profileLogInterval = duration_cast<milliseconds>(interval); }
 
+   // Draws a frame every `drawInterval` and runs a step every `simInterval`, measured from the start of one to the
+   // start of the next; zero runs as fast as possible. See SetTargetFPS() and SetTargetStepRate().
    template <typename _DrawRep, typename _DrawPeriod, typename _SimRep, typename _SimPeriod>
-   void Start(duration<_DrawRep, _DrawPeriod> drawSleepInterval, duration<_SimRep, _SimPeriod> simSleepInterval,
-              function<bool(milliseconds)> haltingCondition) {
-      startThreads(simSleepInterval, haltingCondition);
-      startDrawThread(drawSleepInterval, haltingCondition);
-      while (!haltingCondition(timeElapsed) && !isClosing) { mainThreadLoop(drawSleepInterval); }
+   void Start(duration<_DrawRep, _DrawPeriod> drawInterval, duration<_SimRep, _SimPeriod> simInterval, function<bool()> haltingCondition) {
+      nameThread("main");
+      framePacer.SetPeriod(drawInterval);
+      stepPacer.SetPeriod(simInterval);
+      startThreads(haltingCondition);
+      startDrawThread(haltingCondition);
+      while (!haltingCondition() && !isClosing) { mainThreadLoop(); }
+      joinThreads();
    }
 
    template <typename _DrawRep, typename _DrawPeriod, typename _SimRep, typename _SimPeriod>
-   void Start(duration<_DrawRep, _DrawPeriod> drawSleepInterval, duration<_SimRep, _SimPeriod> simSleepInterval) {
-      startThreads(simSleepInterval);
-      startDrawThread(drawSleepInterval);
-      while (!isClosing) { mainThreadLoop(drawSleepInterval); }
+   void Start(duration<_DrawRep, _DrawPeriod> drawInterval, duration<_SimRep, _SimPeriod> simInterval, function<bool(milliseconds)> haltingCondition) {
+      nameThread("main");
+      framePacer.SetPeriod(drawInterval);
+      stepPacer.SetPeriod(simInterval);
+      startThreads(haltingCondition);
+      startDrawThread(haltingCondition);
+      while (!haltingCondition(timeElapsed) && !isClosing) { mainThreadLoop(); }
+      joinThreads();
    }
 
+   template <typename _DrawRep, typename _DrawPeriod, typename _SimRep, typename _SimPeriod>
+   void Start(duration<_DrawRep, _DrawPeriod> drawInterval, duration<_SimRep, _SimPeriod> simInterval) {
+      nameThread("main");
+      framePacer.SetPeriod(drawInterval);
+      stepPacer.SetPeriod(simInterval);
+      startThreads();
+      startDrawThread();
+      while (!isClosing) { mainThreadLoop(); }
+      joinThreads();
+   }
+
+   // Writes every frame drawn from now on to `path` (see FrameFormat). Frames are read back through pixel buffers a
+   // couple of frames late and encoded on a background thread; if encoding falls behind, frames are dropped rather than
+   // slowing down drawing. Starting a new capture finishes the previous one.
+   void StartCapture(string path, FrameFormat format = FrameFormat::PPM) {
+      // Checked here, since the writer is only created on the draw thread
+      if (format == FrameFormat::PPM && !FrameWriter::IsSequencePattern(path))
+      { throw std::logic_error("Attempted to capture to " + path + ", which needs exactly one integer conversion, e.g. frame%05d.ppm"); }
+      std::lock_guard lock(captureMutex);
+      captureRequest = CaptureRequest{std::move(path), format, -1, true};
+   }
+   // Writes the next drawn frame as a PPM file to `path` as given
+   void Screenshot(string path) {
+      std::lock_guard lock(captureMutex);
+      captureRequest = CaptureRequest{std::move(path), FrameFormat::PPM, 1, false};
+   }
+   void StopCapture() {
+      std::lock_guard lock(captureMutex);
+      captureRequest = CaptureRequest{"", FrameFormat::PPM, 0, false};
+   }
+   // Frames skipped because the encoder was behind, since the capture started
+   uint64_t GetDroppedFrames() const { return droppedFrames; }
+
+   // Writes the buffered trace events as a Chrome trace JSON file. Only recorded when built with PARTICULO_TRACE.
+   bool DumpTrace(const string& path) { return GetTracer().Dump(path); }
+   // Dumps the trace to `path` when Start() returns
+   void SetTraceFile(string path) { traceFile = std::move(path); }
+
 private:
-   template <typename _Rep, typename _Period>
-   void simLoop(int thread, duration<_Rep, _Period> sleepInterval, function<bool()> haltingCondition) {
+   // Labels the calling thread in lock statistics and traces
+   static void nameThread(const string& name) {
+      GetLockProfiler().SetThreadName(name);
+      PARTICULO_TRACE_THREAD(name);
+   }
+
+   // Waits for the simulation and draw threads to finish once the main loop has exited
+   void joinThreads() {
+      for (auto& simThread : simThreads)
+      {
+         if (simThread.joinable()) simThread.join();
+      }
+      simThreads.clear();
+      phaseBarrier.emplace(threadCount);
+      stepBarrier.emplace(threadCount, StepCompletion{this});
+      if (drawThread.joinable()) drawThread.join();
+      if (!traceFile.empty()) DumpTrace(traceFile);
+   }
+
+   void simLoop(int thread, function<bool()> haltingCondition) {
       while (!haltingCondition() && !isClosing)
       {
+         step(thread);
+         PARTICULO_SCOPE(Phase::Sleep);
+         FramePacer::SleepUntil(stepDeadline);
+      }
+      stepBarrier->arrive_and_drop();
+      phaseBarrier->arrive_and_drop();
+   }
+
+   void simLoop(int thread, function<bool(milliseconds)> haltingCondition) {
+      while (!haltingCondition(timeElapsed) && !isClosing)
+      {
+         step(thread);
+         PARTICULO_SCOPE(Phase::Sleep);
+         FramePacer::SleepUntil(stepDeadline);
+      }
+      stepBarrier->arrive_and_drop();
+      phaseBarrier->arrive_and_drop();
+   }
+
+   void simLoop(int thread) {
+      while (!isClosing)
+      {
+         step(thread);
+         PARTICULO_SCOPE(Phase::Sleep);
+         FramePacer::SleepUntil(stepDeadline);
+      }
+      stepBarrier->arrive_and_drop();
+      phaseBarrier->arrive_and_drop();
+   }
+
+   // Sizes the particle storage and arena for p_maxCount particles
+   void reserveParticles() {
+      particles.reserve(p_maxCount);
+      // allocate_shared puts the control block (vtable, counts, allocator) in the same block as the particle. Workers
+      // allocate spawned particles, the other threads whatever Add() and friends create.
+      arena->Reserve(p_maxCount, sizeof(T) + 4 * sizeof(void*), threadCount + 1);
+      // Distinct streams so workers don't spawn in lockstep
+      for (int i = 0; i < threadCount; i++) { spawnRandom[i].seed(i + 1); }
+   }
+   template <typename... _Args>
+   shared_ptr<T> allocateParticle(_Args&&... __args) {
+      return std::allocate_shared<T>(ArenaAllocator<T>(arena), particles.ReserveSlot(), __args...);
+   }
+
+   // One simulation step: every worker simulates its section, then the last worker to finish runs update()
+   void step(int thread) {
+      if (fluidActive) fluidPasses(thread);
+      {
+         SharedLock lock(mtx, LockSite::Simulate, std::defer_lock);
+         {
+            PARTICULO_SCOPE(Phase::SimulateLock);
+            lock.Lock();
+         }
+         if (!replaying && !spawnSlots.empty())
+         {
+            PARTICULO_SCOPE(Phase::Spawn);
+            buildSpawns(thread);
+         }
+         if (!replaying && particles.size() != 0)
+         {
+            PARTICULO_SCOPE(Phase::Simulate);
+            // Sleeping particles sit after the awake ones and are left out of the sections
+            auto [start_index, end_index] = sectionOf(particles.ActiveCount(), thread);
+            auto section = span{particles.begin() + start_index, particles.begin() + end_index};
+            if (forcePass) forcePass(section, stepDelta);
+            simulate(snapshot, section, timeElapsed);
+            if (!solving) finishSection(thread);
+         }
+      }
+      if (solving)
+      {
+         solveConstraints(thread);
+         SharedLock lock(mtx, LockSite::Simulate);
+         // Particles may have been added or removed while the lock was released between colors
+         if (!replaying && particles.size() != 0) finishSection(thread);
+      }
+      stepBarrier->arrive_and_wait();
+   }
+   // This worker's share of the first `count` dense positions
+   std::pair<int, int> sectionOf(size_t count, int thread) const {
+      const int step = count / threadCount;
+      const int start = thread * step;
+      return {start, (thread < threadCount - 1) ? start + step : static_cast<int>(count)};
+   }
+   // Collisions, boundaries and sleep tracking for this worker's awake particles, and ageing for all of its particles,
+   // once positions are final for the step
+   void finishSection(int thread) {
+      auto [start, end] = sectionOf(particles.ActiveCount(), thread);
+      if (!colliderBVH.Empty()) collide(start, end);
+      if (domain.Active()) confine(start, end);
+      if (sleepSpeed > 0.0f) settle(start, end, thread);
+      if (lifetimes)
+      {
+         const int active = static_cast<int>(particles.ActiveCount());
+         auto [first, last] = sectionOf(particles.size() - active, thread);
+         age(start, end, expiredAwake[thread]);
+         age(active + first, active + last, expiredAsleep[thread]);
+         expiredRevision[thread] = particles.Revision();
+      }
+   }
+   // Counts how long each awake particle has been slow and nominates those that have been slow for long enough to
+   // sleep. A particle that is moving wakes sleeping particles it touches, found with the spatial grid.
+   void settle(int start, int end, int thread) {
+      auto& calm = particles.Calm();
+      const float threshold = sleepSpeed * sleepSpeed;
+      for (int i = start; i < end; i++)
+      {
+         auto& p = *particles[i];
+         if (speedSquared(p) < threshold)
+         {
+            if (calm[i] < sleepSteps && ++calm[i] == sleepSteps) drowsy[thread].push_back(particles.HandleAt(i));
+            continue;
+         }
+         calm[i] = 0;
+         if constexpr (BasicParticleV<T>)
+         {
+            if (!grid.Enabled() || snapshotActive == snapshot.size()) continue;
+            float reach = 2.0f * p.radius;
+            grid.ForEachNeighbor(p.pos, reach, [&](uint32_t j, v2d::v2d other) {
+               if (j >= snapshotActive && p.pos.sqrDist(other) < reach * reach) woken[thread].push_back(particles.HandleOf(*snapshot[j]));
+            });
+         }
+      }
+   }
+   // Velocity, or displacement over the last step for Verlet particles
+   static float speedSquared(const T& p) {
+      if constexpr (requires { { p.vel } -> std::convertible_to<v2d::v2d>; })
+      { return p.vel.x * p.vel.x + p.vel.y * p.vel.y; }
+      else if constexpr (requires { { p.prev_pos } -> std::convertible_to<v2d::v2d>; })
+      { return p.pos.sqrDist(p.prev_pos); }
+      else { return std::numeric_limits<float>::infinity(); }
+   }
+   // Wakes contacted and explicitly woken particles, then puts to sleep the nominated ones that are still calm
+   void applySleep() {
+      {
+         std::lock_guard lock(wakeMutex);
+         for (auto handle : wakeRequests) { particles.Wake(handle); }
+         wakeRequests.clear();
+      }
+      for (auto& handles : woken)
+      {
+         for (auto handle : handles) { particles.Wake(handle); }
+         handles.clear();
+      }
+      auto& calm = particles.Calm();
+      for (auto& handles : drowsy)
+      {
+         for (auto handle : handles)
+         {
+            if (particles.Contains(handle) && calm[particles.PositionOf(handle)] >= sleepSteps) particles.Sleep(handle);
+         }
+         handles.clear();
+      }
+   }
+   // Projects one color at a time, each split across the workers, with a barrier after every color. The lock is
+   // released before each barrier so a writer queued on the mutex can't hold up workers that have yet to take it.
+   void solveConstraints(int thread) {
+      PARTICULO_SCOPE(Phase::Constraints);
+      // Every section has to be simulated before any constraint moves a particle
+      phaseBarrier->arrive_and_wait();
+      auto find = [this](ParticleHandle handle) { return particles.Find(handle); };
+      for (int iteration = 0; iteration < solverIterations; iteration++)
+      {
+         for (int color = 0; color < constraints.ColorCount(); color++)
          {
-            shared_lock lock(mtx);
-            if (particles.size() != 0)
             {
-               const int step = particles.size() / threadCount;
-               const int start_index = thread * step;
-               const int end_index = (thread < threadCount - 1) ? start_index + step : particles.size() - 1;
-               auto section = span{particles.begin() + start_index, particles.begin() + end_index};
-               simulate(snapshot, section, timeElapsed);
+               SharedLock lock(mtx, LockSite::Simulate);
+               size_t begin = constraints.ColorBegin(color);
+               size_t end = constraints.ColorEnd(color);
+               if (constraints.IsSerial(color))
+               {
+                  if (thread != 0) end = begin;
+               }
+               else
+               {
+                  const size_t step = (end - begin) / threadCount;
+                  begin += thread * step;
+                  end = (thread < threadCount - 1) ? begin + step : end;
+               }
+               if constexpr (BasicParticleV<T>)
+               {
+                  if (!replaying && stepDelta > 0.0f)
+                  {
+                     for (size_t i = begin; i < end; i++) { constraints.Project(i, stepDelta, find); }
+                  }
+               }
             }
+            phaseBarrier->arrive_and_wait();
          }
-         if (thread == 0)
+      }
+   }
+   // Both SPH passes over this worker's share of the snapshot, with a barrier between them and one after, since
+   // simulate() splits the particles differently. Sleeping particles count towards their neighbours' density but aren't
+   // accelerated; like any other, they wake when a moving particle touches them. As with the constraints, the lock is
+   // released before waiting.
+   void fluidPasses(int /*thread*/) requires(!(BasicParticleV<T> && requires(T a) {
+      { a.vel } -> same_as<v2d::v2d&>;
+   })) {}
+   void fluidPasses(int thread) requires(BasicParticleV<T> && requires(T a) {
+      { a.vel } -> same_as<v2d::v2d&>;
+   }) {
+      PARTICULO_SCOPE(Phase::Fluid);
+      {
+         SharedLock lock(mtx, LockSite::Simulate);
+         auto [begin, end] = sectionOf(snapshot.size(), thread);
+         if (!replaying) fluid.Density(snapshot, grid, begin, end);
+      }
+      phaseBarrier->arrive_and_wait();
+      {
+         SharedLock lock(mtx, LockSite::Simulate);
+         auto [begin, end] = sectionOf(snapshotActive, thread);
+         if (!replaying) fluid.Accelerations(snapshot, grid, begin, end, stepDelta);
+      }
+      phaseBarrier->arrive_and_wait();
+   }
+   void applyFluidChanges() {
+      if (fluidRequested)
+      {
+         fluid.Configure(fluidParams);
+         if (gridCellSize < fluidParams.smoothingLength)
          {
-            unique_lock lock(mtx);
-            update(particles, timeElapsed);
-            snapshot = particles;
+            gridCellSize = fluidParams.smoothingLength;
+            configureGrid();
          }
-         sleep_for(sleepInterval);
       }
+      fluidActive = fluidRequested;
+   }
+   // Applies constraint changes made since the last step; runs while every worker is parked on the step barrier
+   void applyConstraintChanges() {
+      if (clearConstraints) constraints.Clear();
+      clearConstraints = false;
+      if (!pendingConstraints.Empty())
+      {
+         constraints.Append(pendingConstraints);
+         pendingConstraints.Clear();
+         constraints.Color();
+      }
+      // Constraints on removed particles would otherwise be projected, skipped, and drawn from forever
+      if (particles.RemovedCount() != constraintsPrunedAt)
+      {
+         constraints.Prune([this](ParticleHandle handle) { return particles.Contains(handle); });
+         constraintsPrunedAt = particles.RemovedCount();
+      }
+      constraints.ResetLambda();
+      solverIterations = constraintIterations;
+      solving = !constraints.Empty() && solverIterations > 0;
    }
 
-   template <typename _Rep, typename _Period>
-   void simLoop(int thread, duration<_Rep, _Period> sleepInterval, function<bool(milliseconds)> haltingCondition) {
-      while (!haltingCondition(timeElapsed) && !isClosing)
+   // Reserves slots for the particles the emitters owe this step; the workers construct them at the start of the next.
+   // Particles that don't fit under the max count stay owed, up to a second's worth, and are spawned once room frees up.
+   void planSpawns() {
+      size_t available = p_maxCount - particles.size();
+      for (auto& state : emitters)
+      {
+         state.carry += state.emitter->rate * stepDelta;
+         auto count = std::min(static_cast<size_t>(floorf(state.carry)), available - spawnSlots.size());
+         state.carry = std::min(state.carry - count, std::max(state.emitter->rate, 1.0f));
+         if (count == 0) continue;
+         for (size_t i = 0; i < count; i++) { spawnSlots.push_back(particles.ReserveSlot()); }
+         spawnBatches.push_back({*state.emitter, spawnSlots.size()});
+      }
+      spawned.resize(spawnSlots.size());
+   }
+   // Constructs this worker's share of the planned spawns
+   void buildSpawns(int thread) {
+      const size_t step = spawnSlots.size() / threadCount;
+      const size_t start = thread * step;
+      const size_t end = (thread < threadCount - 1) ? start + step : spawnSlots.size();
+      auto batch = std::upper_bound(spawnBatches.begin(), spawnBatches.end(), start, [](size_t i, const SpawnBatch& b) { return i < b.end; });
+      for (size_t i = start; i < end; i++)
+      {
+         while (i >= batch->end) { ++batch; }
+         spawned[i] = buildSpawn(batch->emitter, spawnSlots[i], spawnRandom[thread]);
+      }
+   }
+   shared_ptr<T> buildSpawn(const Emitter& emitter, uint32_t slot, std::minstd_rand& gen) {
+      auto particle = std::allocate_shared<T>(ArenaAllocator<T>(arena), static_cast<int>(slot));
+      auto position = emitter.SamplePosition(gen);
+      if constexpr (BasicParticleV<T>) { particle->pos = position; }
+      else
+      {
+         particle->x = position.x;
+         particle->y = position.y;
+      }
+      if constexpr (requires { { particle->vel } -> same_as<v2d::v2d&>; }) { particle->vel = emitter.SampleVelocity(gen); }
+      if (emitter.radius > 0.0f) particle->radius = emitter.radius;
+      particle->color = emitter.color;
+      return particle;
+   }
+   // Adds the spawns built by the workers in one batch. Spawns planned while the workers were replaying are built here.
+   void publishSpawns() {
+      size_t i = 0;
+      for (auto& batch : spawnBatches)
       {
+         for (; i < batch.end; i++)
          {
-            shared_lock lock(mtx);
-            if (particles.size() != 0)
-            {
-               const int step = particles.size() / threadCount;
-               const int start_index = thread * step;
-               const int end_index = (thread < threadCount - 1) ? start_index + step : particles.size() - 1;
-               auto section = span{particles.begin() + start_index, particles.begin() + end_index};
-               simulate(snapshot, section, timeElapsed);
-            }
+            if (!spawned[i]) spawned[i] = buildSpawn(batch.emitter, spawnSlots[i], spawnRandom[0]);
+            particles.Insert(std::move(spawned[i]), batch.emitter.lifetime);
          }
-         if (thread == 0)
+         if (std::isfinite(batch.emitter.lifetime)) lifetimes = true;
+      }
+      spawnBatches.clear();
+      spawnSlots.clear();
+      spawned.clear();
+   }
+   void collide(int start, int end) {
+      if constexpr (BasicParticleV<T>)
+      {
+         float e = restitution;
+         for (int i = start; i < end; i++)
+         {
+            auto& p = *particles[i];
+            colliderBVH.Query(p.pos.x - p.radius, p.pos.y - p.radius, p.pos.x + p.radius, p.pos.y + p.radius,
+                              [&](const Segment& segment) { ResolveCollision(p, segment, e); });
+         }
+      }
+   }
+   void setCollider(const shared_ptr<GraphicsPrimitive>& primitive, bool collider) {
+      std::erase_if(colliders, [&](const auto& entry) { return entry.first == primitive; });
+      if (collider) colliders.push_back({primitive, primitive->GetRevision()});
+      buildColliders();
+   }
+   void refreshColliders() {
+      bool changed = false;
+      for (auto& [primitive, revision] : colliders)
+      {
+         if (primitive->GetRevision() == revision) continue;
+         revision = primitive->GetRevision();
+         changed = true;
+      }
+      if (changed) buildColliders();
+   }
+   void buildColliders() {
+      vector<Segment> segments;
+      for (auto& [primitive, revision] : colliders)
+      {
+         auto& path = primitive->GetPath();
+         float halfWidth = primitive->GetHalfWidth();
+         for (size_t i = 1; i < path.size(); i++)
+         { segments.push_back({v2d::v2d(path[i - 1].x, path[i - 1].y), v2d::v2d(path[i].x, path[i].y), halfWidth}); }
+      }
+      colliderBVH.Build(std::move(segments));
+      particles.WakeAll();
+   }
+   // Applies the domain boundaries to a worker's section; absorbed particles expire at the end of the step
+   void confine(int start, int end) {
+      auto& life = particles.Lifetimes();
+      for (int i = start; i < end; i++)
+      {
+         if (!domain.Apply(*particles[i])) life[i] = 0.0f;
+      }
+   }
+   void configureGrid() {
+      auto bounds = domain;
+      if (bounds.maxX <= bounds.minX || bounds.maxY <= bounds.minY)
+      {
+         bounds.minX = bounds.minY = 0.0f;
+         bounds.maxX = p_width;
+         bounds.maxY = p_height;
+      }
+      grid.Configure(bounds, gridCellSize);
+      grid.Build(snapshot);
+      // The snapshot may be older than the particles, so the draw can't cull with this grid until the next step
+      gridDrift = INFINITY;
+   }
+   void takeSnapshot() {
+      snapshot = particles.Dense();
+      snapshotActive = particles.ActiveCount();
+      grid.Build(snapshot);
+      gridDrift = culling && grid.Enabled() ? nextStepReach() : INFINITY;
+   }
+   // How far the fastest awake particle moves in the next step at its current speed; infinite for particles without a
+   // velocity, whose motion can't be bounded
+   float nextStepReach() const {
+      float fastest = 0.0f;
+      for (size_t i = 0; i < snapshotActive; i++) { fastest = std::max(fastest, speedSquared(*snapshot[i])); }
+      if constexpr (requires(const T& p) { { p.vel } -> std::convertible_to<v2d::v2d>; }) { return sqrtf(fastest) * stepDelta; }
+      else { return sqrtf(fastest); }
+   }
+   // Ages a worker's section and collects the positions of the particles whose lifetime ran out
+   void age(int start, int end, vector<uint32_t>& dead) {
+      auto& life = particles.Lifetimes();
+      for (int i = start; i < end; i++)
+      {
+         life[i] -= stepDelta;
+         if (life[i] <= 0.0f) dead.push_back(i);
+      }
+   }
+   // Erases the particles the workers found expired. Their sections tile the awake and sleeping partitions in order,
+   // so the positions they collected are already sorted and the gaps are closed without looking up a single handle.
+   // If the particles changed after a worker aged its sections, the positions are stale and the lifetimes are scanned
+   // here instead.
+   void removeExpired() {
+      erasedAwake.clear();
+      erasedAsleep.clear();
+      auto revision = particles.Revision();
+      if (std::all_of(expiredRevision.begin(), expiredRevision.end(), [&](uint64_t seen) { return seen == revision; }))
+      {
+         for (auto& dead : expiredAwake) { erasedAwake.insert(erasedAwake.end(), dead.begin(), dead.end()); }
+         for (auto& dead : expiredAsleep) { erasedAsleep.insert(erasedAsleep.end(), dead.begin(), dead.end()); }
+      }
+      else
+      {
+         auto& life = particles.Lifetimes();
+         for (uint32_t i = 0; i < particles.size(); i++)
          {
-            unique_lock lock(mtx);
-            update(particles, timeElapsed);
-            snapshot = particles;
+            if (life[i] <= 0.0f) (i < particles.ActiveCount() ? erasedAwake : erasedAsleep).push_back(i);
          }
-         sleep_for(sleepInterval);
       }
+      for (auto& dead : expiredAwake) { dead.clear(); }
+      for (auto& dead : expiredAsleep) { dead.clear(); }
+      if (!erasedAwake.empty() || !erasedAsleep.empty()) particles.Erase(erasedAwake, erasedAsleep);
    }
 
-   template <typename _Rep, typename _Period>
-   void simLoop(int thread, duration<_Rep, _Period> sleepInterval) {
-      while (!isClosing)
+   void completeStep() {
+      stepDeadline = stepPacer.Next();
+      if (!replaying)
       {
+         ExclusiveLock lock(mtx, LockSite::Update, std::defer_lock);
          {
-            shared_lock lock(mtx);
-            if (particles.size() != 0)
-            {
-               const int step = particles.size() / threadCount;
-               const int start_index = thread * step;
-               const int end_index = (thread < threadCount - 1) ? start_index + step : particles.size() - 1;
-               auto section = span{particles.begin() + start_index, particles.begin() + end_index};
-               simulate(snapshot, section, timeElapsed);
-            }
+            PARTICULO_SCOPE(Phase::UpdateLock);
+            lock.Lock();
          }
-         if (thread == 0)
+         PARTICULO_SCOPE(Phase::Update);
+         auto now = high_resolution_clock::now();
+         timeElapsed = duration_cast<milliseconds>(now - p_initialTime);
+         stepDelta = fixedTimestep > 0.0f ? fixedTimestep.load() : duration<float>(now - lastStepTime).count();
+         lastStepTime = now;
+         // Before the spawns are inserted, which would move particles away from the positions the workers collected
+         if (lifetimes) removeExpired();
+         publishSpawns();
+         if (sleepSpeed > 0.0f) applySleep();
+         update(particles.Dense(), timeElapsed);
+         refreshColliders();
+         applyConstraintChanges();
+         applyFluidChanges();
+         planSpawns();
+         takeSnapshot();
+         if (fluidActive) fluid.Prepare(snapshot.size());
+         recordStep();
+         lock.Unlock();
+         // Copying the step for the draw thread only reads the particles, so it holds the lock shared: the draw thread
+         // and other readers carry on, and writers still can't change the particles halfway through the copy
+         if (pipelined)
          {
-            unique_lock lock(mtx);
-            update(particles, timeElapsed);
-            snapshot = particles;
+            PARTICULO_SCOPE(Phase::Publish);
+            SharedLock shared(mtx, LockSite::Publish);
+            publishState();
          }
-         sleep_for(sleepInterval);
+      }
+      else
+      {
+         solving = false;
+         fluidActive = false;
       }
    }
 
    void commonDraw() {
+      PARTICULO_SCOPE(Phase::Frame);
+      prepareFrame();
+      renderFrame();
+   }
+   // The part of a frame that reads state other threads write: the view, the primitives and the step to draw. Holds the
+   // lock in pipelined mode; everything after it reads only what it took.
+   void prepareFrame() {
       glClearColor(bgColor.r, bgColor.g, bgColor.b, bgColor.a);
       glClear(GL_COLOR_BUFFER_BIT);
       glViewport(0, 0, p_width, p_height);
@@ -817,103 +1953,389 @@ private:
       screenCorrectionTransform = glm::scale(identity, {2.0f / static_cast<float>(p_width), -2.0f / static_cast<float>(p_height), 1.0f});
       tempMatrix = screenCorrectionTransform * p_transform;
       tempMatrix = glm::translate(tempMatrix, {p_width / -2.0f, p_height / -2.0f, 0.0f});
-      particleShader.SetMatrix4("transform", tempMatrix, true);
-      setParticlePos();
-      updateBuffers();
-      draw();
-      lineShader.SetMatrix4("transform", tempMatrix, true);
-      drawLines();
-      glfwSwapBuffers(window);
+      frameUniforms.Update({tempMatrix, {static_cast<float>(p_width), static_cast<float>(p_height)}, timeElapsed.count() / 1000.0f});
+      frameWidth = p_width;
+      frameHeight = p_height;
+      frameReplaying = replaying;
+      frameDensity = renderMode == RenderMode::Density && !frameReplaying;
+      framePipelined = pipelined && !frameReplaying;
+      if (framePipelined) acquireState();
+      {
+         PARTICULO_SCOPE(Phase::UpdateBuffers);
+         for (auto& primitive : primitives) { primitive->UpdateBuffers(); }
+      }
+      framePrimitives.assign(primitives.begin(), primitives.end());
    }
-
-   void setParticlePos() requires(BasicParticleXY<T>) {
-      int i = 0;
-      for (auto& particle : particles)
+   void renderFrame() {
       {
-         particle_position_size_data[i] = particle->x;
-         particle_position_size_data[i + 1] = particle->y;
-         particle_position_size_data[i + 2] = 0;
-         particle_position_size_data[i + 3] = particle->radius;
-
-         auto [r, g, b, a] = uint32ToFloatColor(particle->color);
-         particle_color_data[i] = r;
-         particle_color_data[i + 1] = g;
-         particle_color_data[i + 2] = b;
-         particle_color_data[i + 3] = a;
+         PARTICULO_SCOPE(Phase::SetParticlePos);
+         if (frameDensity) { splatDensity(); }
+         else if (frameReplaying) { setReplayPos(); }
+         else { setParticlePos(); }
+      }
+      {
+         PARTICULO_SCOPE(Phase::UpdateBuffers);
+         if (frameDensity) { uploadDensity(); }
+         else { updateParticleBuffers(); }
+      }
+      {
+         PARTICULO_SCOPE(Phase::Draw);
+         if (frameDensity) { drawDensity(); }
+         else
+         {
+            particleShader.Use();
+            draw();
+         }
+      }
+      {
+         PARTICULO_SCOPE(Phase::DrawLines);
+         lineShader.Use();
+         drawLines();
+         drawConstraints();
+      }
+      {
+         PARTICULO_SCOPE(Phase::Capture);
+         captureFrame();
+      }
+      if (window)
+      {
+         PARTICULO_SCOPE(Phase::SwapBuffers);
+         glfwSwapBuffers(window);
+      }
+   }
 
-         i += 4;
+   // Copies what the draw thread needs of the step just completed into the back state and makes it the latest
+   void publishState() {
+      auto& state = *backState;
+      state.particles.clear();
+      for (auto& particle : particles) { state.particles.push_back({PositionOf(*particle), particle->radius, particle->color}); }
+      state.constraintVertices.clear();
+      packConstraints(state.constraintVertices);
+      std::lock_guard lock(stateMutex);
+      std::swap(backState, readyState);
+      stateReady = true;
+   }
+   // Takes the latest published step, if there is one newer than the front state
+   void acquireState() {
+      std::lock_guard lock(stateMutex);
+      if (!stateReady) return;
+      std::swap(frontState, readyState);
+      stateReady = false;
+   }
+
+   void setParticlePos() {
+      auto view = visibleBounds();
+      instanceCount = packParticles(particle_position_size_data.data(), particle_color_data.data(), culling ? &view : nullptr, &pointCount,
+                                    framePipelined ? &frontState->particles : nullptr);
+   }
+
+   // Maps world positions to clip space. Particles are drawn at (x, y, 1, 1), so this is the 2D affine map made of the
+   // x and y rows of the draw transform.
+   Affine2D clipTransform() const {
+      return {tempMatrix[0][0], tempMatrix[1][0], tempMatrix[0][1], tempMatrix[1][1], tempMatrix[2][0] + tempMatrix[3][0],
+              tempMatrix[2][1] + tempMatrix[3][1]};
+   }
+   // World-space rectangle enclosing everything the current transform puts on screen
+   Bounds visibleBounds() const {
+      auto toClip = clipTransform();
+      if (toClip.Determinant() == 0.0f) return {-INFINITY, -INFINITY, INFINITY, INFINITY};
+      auto toWorld = toClip.Inverse();
+      Bounds bounds = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+      for (float x : {-1.0f, 1.0f})
+      {
+         for (float y : {-1.0f, 1.0f})
+         {
+            auto corner = toWorld.Apply(v2d::v2d(x, y));
+            bounds = {std::min(bounds.minX, corner.x), std::min(bounds.minY, corner.y), std::max(bounds.maxX, corner.x),
+                      std::max(bounds.maxY, corner.y)};
+         }
       }
+      return bounds;
    }
 
-   void setParticlePos() requires(BasicParticleV<T>) {
+   // Packs particles into the instance arrays, skipping those entirely outside `view` if it's given. If `points` is
+   // given, particles whose on-screen radius is below the point threshold are packed backwards from the end of the
+   // arrays and counted there, with their alpha scaled by the fraction of the pixel they cover. Returns the number of
+   // particles packed from the front. Packs `instances` instead of the live particles if given.
+   int packParticles(GLfloat* position_size_data, GLfloat* color_data, const Bounds* view = nullptr, int* points = nullptr,
+                     const vector<ParticleInstance>* instances = nullptr)
+      requires(ColorfulParticle<T>)
+   {
       int i = 0;
-      for (auto& particle : particles)
-      {
-         particle_position_size_data[i] = particle->pos.x;
-         particle_position_size_data[i + 1] = particle->pos.y;
-         particle_position_size_data[i + 2] = 0;
-         particle_position_size_data[i + 3] = particle->radius;
+      int last = p_maxCount * 4;
+      // Pixels per world unit; only the draw thread may read the draw transform
+      float pixelScale = points ? sqrtf(fabsf(clipTransform().Determinant()) * frameWidth * frameHeight / 4.0f) : 0.0f;
+      float threshold = points ? pointThreshold.load() : 0.0f;
+      auto pack = [&](v2d::v2d pos, float radius, uint32_t color) {
+         if (view && !view->Overlaps(pos, radius)) return;
+         float pixels = radius * pixelScale;
+         if (pixels < threshold && last - 4 >= i)
+         {
+            last -= 4;
+            position_size_data[last] = pos.x;
+            position_size_data[last + 1] = pos.y;
+            auto [r, g, b, a] = uint32ToFloatColor(color);
+            color_data[last] = r;
+            color_data[last + 1] = g;
+            color_data[last + 2] = b;
+            color_data[last + 3] = a * std::min(static_cast<float>(M_PI) * pixels * pixels, 1.0f);
+            return;
+         }
+         position_size_data[i] = pos.x;
+         position_size_data[i + 1] = pos.y;
+         position_size_data[i + 2] = 0;
+         position_size_data[i + 3] = radius;
 
-         auto [r, g, b, a] = uint32ToFloatColor(particle->color);
-         particle_color_data[i] = r;
-         particle_color_data[i + 1] = g;
-         particle_color_data[i + 2] = b;
-         particle_color_data[i + 3] = a;
+         auto [r, g, b, a] = uint32ToFloatColor(color);
+         color_data[i] = r;
+         color_data[i + 1] = g;
+         color_data[i + 2] = b;
+         color_data[i + 3] = a;
 
          i += 4;
+      };
+      if (instances)
+      {
+         for (auto& instance : *instances) { pack(instance.pos, instance.radius, instance.color); }
+      }
+      else if (view && cullWithGrid(*view))
+      {
+         // Particles may have moved up to a step since the grid was built: the box is grown by the distance the fastest
+         // covers in a step, plus a cell for what it gains on the way
+         float margin = grid.MaxRadius() + gridDrift + grid.CellSize();
+         grid.ForEachInBox(view->minX - margin, view->minY - margin, view->maxX + margin, view->maxY + margin,
+                           [&](uint32_t index) { pack(PositionOf(*snapshot[index]), snapshot[index]->radius, snapshot[index]->color); });
+      }
+      else
+      {
+         for (auto& particle : particles) { pack(PositionOf(*particle), particle->radius, particle->color); }
       }
+      if (points) *points = (p_maxCount * 4 - last) / 4;
+      return i / 4;
+   }
+   // The grid only helps when it is current, the particles' motion since it was built is bounded and the view covers
+   // part of the domain. Wrapped grids file particles that crossed an edge on the other side, which a clamped box query
+   // would miss.
+   bool cullWithGrid(const Bounds& view) const {
+      if (!grid.Enabled() || grid.Wraps() || snapshot.size() != particles.size() || !std::isfinite(gridDrift)) return false;
+      float viewArea = (view.maxX - view.minX) * (view.maxY - view.minY);
+      auto& area = grid.GetBounds();
+      return viewArea < 0.5f * (area.maxX - area.minX) * (area.maxY - area.minY);
+   }
+
+   // Counts particles per pixel on the splat workers
+   void splatDensity() {
+      if (!densityPool)
+      { densityPool = std::make_unique<WorkerPool>(threadCount, [](int worker) { nameThread("splat " + std::to_string(worker)); }); }
+      densityMap.Resize(frameWidth, frameHeight, densityPool->Size());
+      // Clip space to pixels, with row 0 at the bottom as textures expect
+      auto toClip = clipTransform();
+      float sx = 0.5f * frameWidth, sy = 0.5f * frameHeight;
+      Affine2D toPixels = {toClip.a * sx, toClip.b * sx, toClip.c * sy, toClip.d * sy, (toClip.tx + 1.0f) * sx, (toClip.ty + 1.0f) * sy};
+      if (framePipelined)
+      {
+         auto& instances = frontState->particles;
+         densityPool->Run([&](int worker) { densityMap.Splat(instances.size(), [&](size_t i) { return instances[i].pos; }, toPixels, worker); });
+      }
+      else
+      {
+         auto& dense = particles.Dense();
+         densityPool->Run([&](int worker) { densityMap.Splat(dense, toPixels, worker); });
+      }
+      densityPool->Run([&](int worker) { densityMap.Reduce(worker); });
+   }
+   void uploadDensity() {
+      int width = densityMap.GetWidth(), height = densityMap.GetHeight();
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, densityTexture);
+      if (width != densityTextureWidth || height != densityTextureHeight)
+      {
+         glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, densityMap.Data());
+         densityTextureWidth = width;
+         densityTextureHeight = height;
+      }
+      else { glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_FLOAT, densityMap.Data()); }
+   }
+   void drawDensity() {
+      densityShader.SetFloat("logMax", logf(1.0f + std::max(densityMap.Max(), 1.0f)), true);
+      glBindVertexArray(densityVAO);
+      glDrawArrays(GL_TRIANGLES, 0, 3);
+   }
+
+   // Reads back the frame just drawn if a capture is running, and hands finished reads to the writer. Runs on the
+   // thread that owns the GL context.
+   void captureFrame() {
+      {
+         std::lock_guard lock(captureMutex);
+         if (captureRequest)
+         {
+            finishCapture();
+            if (captureRequest->frames != 0)
+            {
+               captureWriter = std::make_unique<FrameWriter>(captureRequest->path, captureRequest->format, captureRequest->sequence);
+               captureReadback = std::make_unique<PixelReadback>();
+               captureFramesLeft = captureRequest->frames;
+               captureIndex = 0;
+               droppedFrames = 0;
+            }
+            captureRequest.reset();
+         }
+      }
+      if (!captureWriter) return;
+      CapturedFrame frame;
+      if (captureFramesLeft != 0 && frameWidth > 0 && frameHeight > 0)
+      {
+         if (captureReadback->Bytes() != static_cast<size_t>(frameWidth) * frameHeight * 4)
+         {
+            // Resizing drops the reads in flight, so finish them first
+            while (captureReadback->Pending() > 0)
+            {
+               if (captureReadback->Collect(frame, true)) captureWriter->Write(std::move(frame));
+            }
+            captureReadback->Resize(frameWidth, frameHeight);
+         }
+         if (captureWriter->Backlog() >= MaxCaptureBacklog) { droppedFrames++; }
+         else
+         {
+            if (captureReadback->Queue(captureIndex++, frame)) captureWriter->Write(std::move(frame));
+            if (captureFramesLeft > 0) captureFramesLeft--;
+         }
+      }
+      while (captureReadback->Collect(frame)) { captureWriter->Write(std::move(frame)); }
+   }
+   // Waits for the reads in flight and the writer, then releases them; needs the GL context
+   void finishCapture() {
+      if (!captureWriter) return;
+      CapturedFrame frame;
+      while (captureReadback->Pending() > 0)
+      {
+         if (captureReadback->Collect(frame, true)) captureWriter->Write(std::move(frame));
+      }
+      captureReadback.reset();
+      captureWriter.reset();
+      captureFramesLeft = 0;
+   }
+
+   // Advances the replay clock and copies the current recorded frame into the instance arrays
+   void setReplayPos() {
+      auto now = high_resolution_clock::now();
+      double frameTime = duration<double>(now - lastFrameTime).count();
+      lastFrameTime = now;
+      auto seek = replaySeek.exchange(-1);
+      if (seek >= 0)
+      {
+         replayStep = std::min<uint64_t>(seek, player.GetStepCount() - 1);
+         replayTime = player.GetFrame(replayStep).time;
+      }
+      else
+      {
+         replayTime += frameTime * replaySpeed;
+         while (replayStep + 1 < player.GetStepCount() && player.GetFrame(replayStep + 1).time <= replayTime) { replayStep++; }
+      }
+      instanceCount = player.CopyFrame(replayStep, particle_position_size_data.data(), particle_color_data.data());
+      pointCount = 0;
+   }
+
+   void recordStep() {
+      if (!recorder.IsOpen()) return;
+      auto count = packParticles(record_position_size_data.data(), record_color_data.data());
+      recorder.Write(record_position_size_data.data(), record_color_data.data(), count, timeElapsed.count() / 1000.0f);
    }
 
    void draw() requires(ColorfulParticle<T>) {
-      // 1st attribute buffer : vertices
-      glEnableVertexAttribArray(0);
-      glBindBuffer(GL_ARRAY_BUFFER, billboard_vertex_buffer);
-      glVertexAttribPointer(0, // attribute. No particular reason for 0, but must
-                               // match the layout in the shader.
-                            3,        // size
-                            GL_FLOAT, // type
-                            GL_FALSE, // normalized?
-                            0,        // stride
-                            (void*) 0 // array buffer offset
-      );
-
-      // 2nd attribute buffer : positions of particles' centers
-      glEnableVertexAttribArray(1);
-      glBindBuffer(GL_ARRAY_BUFFER, particles_position_buffer);
-      glVertexAttribPointer(1, // attribute. No particular reason for 1, but must
-                               // match the layout in the shader.
-                            4,        // size : x + y + z + size => 4
-                            GL_FLOAT, // type
-                            GL_FALSE, // normalized?
-                            0,        // stride
-                            (void*) 0 // array buffer offset
-      );
-
-      // 3rd attribute buffer : particles' colors
-      glEnableVertexAttribArray(2);
-      glBindBuffer(GL_ARRAY_BUFFER, particles_color_buffer);
-      glVertexAttribPointer(2, // attribute. No particular reason for 2, but must match the layout
-                               // in the shader.
-                            4,        // size : r + g + b + a => 4
-                            GL_FLOAT, // type
-                            GL_TRUE,  // normalized? *** YES, this means that the unsigned char[4]
-                                      // will be accessible with a vec4 (floats) in the shader ***
-                            0,        // stride
-                            (void*) 0 // array buffer offset
-      );
-
-      // cout << glVertexAttribDivisor << endl;
-      glVertexAttribDivisor(0, 0); // particles vertices : always reuse the same 4 vertices -> 0
-      glVertexAttribDivisor(1, 1); // positions : one per quad (its center) -> 1
-      glVertexAttribDivisor(2, 1); // color : one per quad -> 1
-
-      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, p_maxCount);
+      glBindVertexArray(particleVAO);
+      glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instanceCount);
+
+      if (pointCount == 0) return;
+      // Sub-pixel particles, packed at the end of the arrays, are one point each
+      pointShader.Use();
+      glBindVertexArray(pointVAO);
+      glDrawArrays(GL_POINTS, p_maxCount - pointCount, pointCount);
    }
 
    void drawLines() {
-      for (auto& primitive : primitives) { primitive->Draw(); }
+      for (auto& primitive : framePrimitives) { primitive->Draw(); }
+   }
+   // Constraints as GL_LINES through the line shader, in one constant color
+   void drawConstraints() {
+      uint32_t color = constraintColor;
+      if (frameReplaying || (color & 0xff) == 0) return;
+      auto* vertices = &frontState->constraintVertices;
+      if (!framePipelined)
+      {
+         constraintVertices.clear();
+         packConstraints(constraintVertices);
+         vertices = &constraintVertices;
+      }
+      if (vertices->empty()) return;
+      glNamedBufferData(constraintBuffer, vertices->size() * sizeof(GLfloat), vertices->data(), GL_STREAM_DRAW);
+      glBindVertexArray(constraintVAO);
+      auto [r, g, b, a] = uint32ToFloatColor(color);
+      glVertexAttrib4f(1, r, g, b, a);
+      glDrawArrays(GL_LINES, 0, vertices->size() / 2);
+   }
+   // Appends the two end points of every constraint whose particles still exist
+   void packConstraints(vector<GLfloat>& vertices) {
+      if constexpr (BasicParticleV<T>)
+      {
+         constraints.ForEachPair([&](ParticleHandle a, ParticleHandle b) {
+            auto pa = particles.Find(a);
+            auto pb = particles.Find(b);
+            if (pa && pb) vertices.insert(vertices.end(), {pa->pos.x, pa->pos.y, pb->pos.x, pb->pos.y});
+         });
+      }
    }
 
+#ifdef PARTICULO_EGL
+   // Prefers Mesa's surfaceless platform, which needs no display server, and renders into a framebuffer object
+   void eglInit(int width, int height) {
+      p_width = width;
+      p_height = height;
+      auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+      if (getPlatformDisplay) eglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+      if (eglDisplay == EGL_NO_DISPLAY) eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+      if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, nullptr, nullptr)) throw std::runtime_error("Unable to initialize EGL");
+      if (!eglBindAPI(EGL_OPENGL_API)) throw std::runtime_error("EGL has no desktop OpenGL");
+
+      // Surfaceless displays may have no pbuffer configs
+      EGLConfig config;
+      EGLint configCount = 0;
+      for (EGLint surfaceType : {EGL_PBUFFER_BIT, 0})
+      {
+         const EGLint attributes[] = {EGL_SURFACE_TYPE, surfaceType, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8,
+                                      EGL_BLUE_SIZE,    8,           EGL_ALPHA_SIZE,      8,              EGL_NONE};
+         if (eglChooseConfig(eglDisplay, attributes, &config, 1, &configCount) && configCount > 0) break;
+      }
+      if (configCount == 0) throw std::runtime_error("No suitable EGL config");
+      const EGLint contextAttributes[] = {EGL_CONTEXT_MAJOR_VERSION,       4, EGL_CONTEXT_MINOR_VERSION, 5, EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                          EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+      eglContext = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, contextAttributes);
+      if (eglContext == EGL_NO_CONTEXT) throw std::runtime_error("Unable to create an OpenGL 4.5 EGL context");
+      if (!eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext))
+      {
+         // Without EGL_KHR_surfaceless_context a context needs a surface to be current, even if nothing draws to it
+         const EGLint surfaceAttributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+         eglSurface = eglCreatePbufferSurface(eglDisplay, config, surfaceAttributes);
+         if (eglSurface == EGL_NO_SURFACE || !eglMakeCurrent(eglDisplay, eglSurface, eglSurface, eglContext))
+         { throw std::runtime_error("Unable to make the EGL context current"); }
+      }
+      if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(eglGetProcAddress))) throw std::runtime_error("Unable to load OpenGL");
+      // stderr, since stdout may be carrying raw frames (FrameFormat::Raw to "-")
+      fprintf(stderr, "%s\n", glGetString(GL_VERSION));
+
+      glGenRenderbuffers(1, &offscreenColor);
+      glBindRenderbuffer(GL_RENDERBUFFER, offscreenColor);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, p_width, p_height);
+      glGenFramebuffers(1, &offscreenFramebuffer);
+      glBindFramebuffer(GL_FRAMEBUFFER, offscreenFramebuffer);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, offscreenColor);
+      if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) throw std::runtime_error("Offscreen framebuffer is incomplete");
+      glViewport(0, 0, p_width, p_height);
+      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      glEnable(GL_BLEND);
+   }
+#endif
+
    void gfxInit(int width, int height) {
       p_width = width;
       p_height = height;
@@ -934,7 +2356,7 @@ private:
       gladLoadGL();
 
       // Set viewport
-      printf("%s\n", glGetString(GL_VERSION));
+      fprintf(stderr, "%s\n", glGetString(GL_VERSION));
       glfwGetFramebufferSize(window, &p_width, &p_height);
       glViewport(0, 0, p_width, p_height);
       glMatrixMode(GL_PROJECTION);
@@ -950,137 +2372,172 @@ private:
       glfwSetCursorPosCallback(window, s_MouseMoveCallback);
       glfwSetCharCallback(window, s_KeyboardTypeCallback);
       glfwSetKeyCallback(window, s_KeypressCallback);
-      glfwSwapInterval(1);
+      applySwapInterval();
    }
 
-   void updateBuffers() {
-      glBindBuffer(GL_ARRAY_BUFFER, particles_position_buffer);
-      glBufferData(GL_ARRAY_BUFFER, p_maxCount * 4 * sizeof(GLfloat), NULL,
-                   GL_STREAM_DRAW); // Buffer orphaning, a common way to improve
-                                    // streaming perf. See above link for details.
-      glBufferSubData(GL_ARRAY_BUFFER, 0, p_maxCount * sizeof(GLfloat) * 4, particle_position_size_data.data());
-
-      glBindBuffer(GL_ARRAY_BUFFER, particles_color_buffer);
-      glBufferData(GL_ARRAY_BUFFER, p_maxCount * 4 * sizeof(GLfloat), NULL,
-                   GL_STREAM_DRAW); // Buffer orphaning, a common way to improve
-                                    // streaming perf. See above link for details.
-      glBufferSubData(GL_ARRAY_BUFFER, 0, p_maxCount * sizeof(GLfloat) * 4, particle_color_data.data());
+   void updateParticleBuffers() {
+      // Orphaning the buffers lets the driver hand out fresh storage instead of waiting for the last frame's draw
+      glNamedBufferData(particles_position_buffer, p_maxCount * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+      glNamedBufferSubData(particles_position_buffer, 0, instanceCount * sizeof(GLfloat) * 4, particle_position_size_data.data());
+      uploadPoints(particles_position_buffer, particle_position_size_data);
 
-      for (auto& primitive : primitives) { primitive->UpdateBuffers(); }
+      glNamedBufferData(particles_color_buffer, p_maxCount * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+      glNamedBufferSubData(particles_color_buffer, 0, instanceCount * sizeof(GLfloat) * 4, particle_color_data.data());
+      uploadPoints(particles_color_buffer, particle_color_data);
+   }
+   // Uploads the points packed at the end of an instance array
+   void uploadPoints(GLuint buffer, const vector<GLfloat>& data) {
+      if (pointCount == 0) return;
+      size_t first = static_cast<size_t>(p_maxCount - pointCount) * 4;
+      glNamedBufferSubData(buffer, first * sizeof(GLfloat), pointCount * sizeof(GLfloat) * 4, data.data() + first);
    }
 
    void bufferInit() requires(ColorfulParticle<T>) {
       particle_position_size_data.resize(p_maxCount * 4);
       particle_color_data.resize(p_maxCount * 4);
-      particles.reserve(p_maxCount);
       particleShader.CompileStrings(ParticleVertexShader, ParticleFragmentShader);
       lineShader.CompileStrings(LineVertexShader, LineFragmentShader);
+      pointShader.CompileStrings(PointVertexShader, LineFragmentShader);
+      densityShader.CompileStrings(DensityVertexShader, DensityFragmentShader);
+      frameUniforms.Create(FrameUniforms::Binding);
+      // The full-screen pass has no attributes
+      glCreateVertexArrays(1, &densityVAO);
+      glGenTextures(1, &densityTexture);
+      glBindTexture(GL_TEXTURE_2D, densityTexture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
       static const GLfloat vertices[] = {
           -1.0f, -1.0f, 0.0f, 1.0f, -1.0f, 0.0f, -1.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f,
       };
-      GLuint VBO;
-      glGenBuffers(1, &VBO);
-      glBindBuffer(GL_ARRAY_BUFFER, VBO);
-      glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*) 0);
-      glEnableVertexAttribArray(0);
-
-      glGenVertexArrays(1, &VAO);
-      glBindVertexArray(VAO);
-      glBindBuffer(GL_ARRAY_BUFFER, VBO);
-      glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*) 0);
-      glEnableVertexAttribArray(0);
-      glBindVertexArray(VAO);
-
-      glGenBuffers(1, &billboard_vertex_buffer);
-      glBindBuffer(GL_ARRAY_BUFFER, billboard_vertex_buffer);
-      glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
-      // The VBO containing the positions and sizes of the particles
-      glGenBuffers(1, &particles_position_buffer);
-      glBindBuffer(GL_ARRAY_BUFFER, particles_position_buffer);
-      // Initialize with empty (NULL) buffer : it will be updated later, each
-      // frame.
-      glBufferData(GL_ARRAY_BUFFER, p_maxCount * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
-
-      // The VBO containing the colors of the particles
-      glGenBuffers(1, &particles_color_buffer);
-      glBindBuffer(GL_ARRAY_BUFFER, particles_color_buffer);
-      // Initialize with empty (NULL) buffer : it will be updated later, each
-      // frame.
-      glBufferData(GL_ARRAY_BUFFER, p_maxCount * 4 * sizeof(GLubyte), NULL, GL_STREAM_DRAW);
-   }
-
-   template <typename _Rep, typename _Period>
-   void startThreads(duration<_Rep, _Period> sleepInterval, function<bool()> haltingCondition) {
+      glCreateBuffers(1, &billboard_vertex_buffer);
+      glNamedBufferStorage(billboard_vertex_buffer, sizeof(vertices), vertices, 0);
+      // Positions and sizes, then colors, of the particles; filled every frame
+      glCreateBuffers(1, &particles_position_buffer);
+      glNamedBufferData(particles_position_buffer, p_maxCount * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+      glCreateBuffers(1, &particles_color_buffer);
+      glNamedBufferData(particles_color_buffer, p_maxCount * 4 * sizeof(GLfloat), NULL, GL_STREAM_DRAW);
+
+      glCreateVertexArrays(1, &particleVAO);
+      vertexAttribute(particleVAO, 0, billboard_vertex_buffer, 3);
+      vertexAttribute(particleVAO, 1, particles_position_buffer, 4, 1);
+      vertexAttribute(particleVAO, 2, particles_color_buffer, 4, 1);
+      glCreateVertexArrays(1, &pointVAO);
+      vertexAttribute(pointVAO, 1, particles_position_buffer, 4);
+      vertexAttribute(pointVAO, 2, particles_color_buffer, 4);
+
+      glCreateBuffers(1, &constraintBuffer);
+      glCreateVertexArrays(1, &constraintVAO);
+      vertexAttribute(constraintVAO, 0, constraintBuffer, 2);
+   }
+
+   void startThreads(function<bool()> haltingCondition) {
       for (int i = 0; i < threadCount; i++)
       {
-         simThreads.emplace_back([this, sleepInterval, &haltingCondition, i] { simLoop(i, sleepInterval, haltingCondition); });
+         simThreads.emplace_back([this, haltingCondition, i] {
+            nameThread("worker " + std::to_string(i));
+            simLoop(i, haltingCondition);
+         });
       }
    }
 
-   template <typename _Rep, typename _Period>
-   void startThreads(duration<_Rep, _Period> sleepInterval, function<bool(milliseconds)> haltingCondition) {
+   void startThreads(function<bool(milliseconds)> haltingCondition) {
       for (int i = 0; i < threadCount; i++)
       {
-         simThreads.emplace_back([this, sleepInterval, &haltingCondition, i] { simLoop(i, sleepInterval, haltingCondition); });
+         simThreads.emplace_back([this, haltingCondition, i] {
+            nameThread("worker " + std::to_string(i));
+            simLoop(i, haltingCondition);
+         });
       }
    }
 
-   template <typename _Rep, typename _Period>
-   void startThreads(duration<_Rep, _Period> sleepInterval) {
+   void startThreads() {
       for (int i = 0; i < threadCount; i++)
       {
-         simThreads.emplace_back([this, sleepInterval, i] { simLoop(i, sleepInterval); });
+         simThreads.emplace_back([this, i] {
+            nameThread("worker " + std::to_string(i));
+            simLoop(i);
+         });
       }
    }
-   template <typename _Rep, typename _Period>
-   void startDrawThread(duration<_Rep, _Period> sleepInterval) {
-      drawThread = thread([this, sleepInterval] {
+   void startDrawThread() {
+      drawThread = thread([this] {
+         nameThread("draw");
          glfwMakeContextCurrent(window);
-         while (!isClosing) { loop(sleepInterval); }
+         while (!isClosing) { loop(); }
+         finishCapture();
       });
    }
-   template <typename _Rep, typename _Period>
-   void startDrawThread(duration<_Rep, _Period> sleepInterval, function<bool()> haltingCondition) {
-      drawThread = thread([this, sleepInterval, &haltingCondition] {
+   void startDrawThread(function<bool()> haltingCondition) {
+      drawThread = thread([this, haltingCondition] {
+         nameThread("draw");
          glfwMakeContextCurrent(window);
-         while (!haltingCondition() && !isClosing) { loop(sleepInterval); }
+         while (!haltingCondition() && !isClosing) { loop(); }
+         finishCapture();
       });
    }
-   template <typename _Rep, typename _Period>
-   void startDrawThread(duration<_Rep, _Period> sleepInterval, function<bool(milliseconds)> haltingCondition) {
-      drawThread = thread([this, sleepInterval, &haltingCondition] {
+   void startDrawThread(function<bool(milliseconds)> haltingCondition) {
+      drawThread = thread([this, haltingCondition] {
+         nameThread("draw");
          glfwMakeContextCurrent(window);
-         while (!haltingCondition(timeElapsed) && !isClosing) { loop(sleepInterval); }
+         while (!haltingCondition(timeElapsed) && !isClosing) { loop(); }
+         finishCapture();
       });
    }
 
-   template <typename _Rep, typename _Period>
-   void loop(duration<_Rep, _Period> sleepInterval) {
+   void loop() {
       if (swapInterval)
       {
-         unique_lock lock(mtx);
+         ExclusiveLock lock(mtx, LockSite::SwapInterval);
          swapInterval = false;
-         glfwSwapInterval(1);
+         applySwapInterval();
       }
       {
-         shared_lock lock(mtx);
-         tick();
+         SharedLock lock(mtx, LockSite::Draw, std::defer_lock);
+         {
+            PARTICULO_SCOPE(Phase::DrawLock);
+            lock.Lock();
+         }
+         PARTICULO_SCOPE(Phase::Frame);
+         prepareFrame();
+         if (framePipelined) lock.Unlock();
+         renderFrame();
       }
-      sleep_for(sleepInterval);
+      PARTICULO_SCOPE(Phase::Sleep);
+      framePacer.Wait();
+   }
+   // Needs the window's context
+   void applySwapInterval() {
+      auto mode = vsync.load();
+      if (mode == Vsync::Adaptive && !glfwExtensionSupported("WGL_EXT_swap_control_tear") && !glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+      { mode = Vsync::On; }
+      glfwSwapInterval(mode == Vsync::Adaptive ? -1 : mode == Vsync::On ? 1 : 0);
    }
 
-   template <typename _Rep, typename _Period>
-   void mainThreadLoop(duration<_Rep, _Period> sleepInterval) {
-      glfwPollEvents();
+   void mainThreadLoop() {
       {
-         unique_lock lock(mtx);
+         PARTICULO_SCOPE(Phase::PollEvents);
+         // Blocks until an event arrives or a frame has passed, rather than polling and sleeping
+         auto period = framePacer.GetPeriod();
+         glfwWaitEventsTimeout(period.count() > 0 ? duration<double>(period).count() : 0.001);
+      }
+      {
+         ExclusiveLock lock(mtx, LockSite::MainLoop, std::defer_lock);
+         {
+            PARTICULO_SCOPE(Phase::MainLock);
+            lock.Lock();
+         }
          glfwGetFramebufferSize(window, &p_width, &p_height);
          timeElapsed = duration_cast<milliseconds>(high_resolution_clock::now() - p_initialTime);
       }
-      sleep_for(sleepInterval);
+      if (profileLogInterval.count() > 0 && timeElapsed - lastProfileLog >= profileLogInterval)
+      {
+         lastProfileLog = timeElapsed;
+         GetProfiler().Log(cout);
+         GetLockProfiler().Log(cout);
+         ResetProfile();
+      }
    }
 };
 
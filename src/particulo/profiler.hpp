@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace Particulo
+{
+// Phases of the simulation, draw and main loops that are timed when PARTICULO_PROFILE is defined
+enum class Phase
+{
+   SimulateLock,
+   Spawn,
+   Fluid,
+   Simulate,
+   Constraints,
+   UpdateLock,
+   Update,
+   Publish,
+   DrawLock,
+   Frame,
+   SetParticlePos,
+   UpdateBuffers,
+   Draw,
+   DrawLines,
+   Capture,
+   SwapBuffers,
+   PollEvents,
+   MainLock,
+   Sleep,
+   Count
+};
+
+inline const char* PhaseName(Phase phase) {
+   static constexpr const char* names[] = {
+       "simulate_lock", "spawn",       "fluid",        "simulate",    "constraints", "update_lock", "update",      "publish",
+       "draw_lock",     "frame",       "set_particle_pos", "update_buffers", "draw",    "draw_lines",  "capture",
+       "swap_buffers",  "poll_events", "main_lock",    "sleep",
+   };
+   return names[static_cast<int>(phase)];
+}
+
+// Timings in milliseconds
+struct PhaseStats
+{
+   uint64_t count = 0;
+   double p50 = 0.0;
+   double p99 = 0.0;
+   double max = 0.0;
+};
+
+// Log-linear histogram of nanosecond durations: 8 sub-buckets per power of two, so percentiles are accurate to
+// within 12.5%. Each histogram has a single writer thread, which only needs relaxed loads and stores.
+class Histogram
+{
+public:
+   static constexpr int SubBits = 3;
+   static constexpr int SubCount = 1 << SubBits;
+   static constexpr int BucketCount = (64 - SubBits + 1) * SubCount;
+
+public:
+   void Record(uint64_t ns) {
+      auto& bucket = buckets[bucketIndex(ns)];
+      bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      if (ns > max.load(std::memory_order_relaxed)) { max.store(ns, std::memory_order_relaxed); }
+   }
+   // Adds this histogram's counts into `counts` and returns its maximum
+   uint64_t Accumulate(std::array<uint64_t, BucketCount>& counts) const {
+      for (int i = 0; i < BucketCount; i++) { counts[i] += buckets[i].load(std::memory_order_relaxed); }
+      return max.load(std::memory_order_relaxed);
+   }
+   void ResetMax() { max.store(0, std::memory_order_relaxed); }
+
+   static int bucketIndex(uint64_t ns) {
+      if (ns < SubCount) return static_cast<int>(ns);
+      int exponent = std::bit_width(ns) - 1;
+      int sub = static_cast<int>((ns >> (exponent - SubBits)) & (SubCount - 1));
+      return (exponent - SubBits + 1) * SubCount + sub;
+   }
+   // Midpoint of a bucket in nanoseconds
+   static double bucketValue(int index) {
+      if (index < SubCount) return index;
+      int exponent = index / SubCount + SubBits - 1;
+      int sub = index % SubCount;
+      double low = static_cast<double>((uint64_t(1) << exponent) + (uint64_t(sub) << (exponent - SubBits)));
+      return low + static_cast<double>(uint64_t(1) << (exponent - SubBits)) / 2.0;
+   }
+
+private:
+   std::array<std::atomic<uint64_t>, BucketCount> buckets = {};
+   std::atomic<uint64_t> max = 0;
+};
+
+// Process-wide registry of per-thread histograms. Threads register once on first use; after that recording never
+// takes a lock. Readers sum the per-thread histograms and subtract the baseline taken at the last Reset().
+class Profiler
+{
+private:
+   struct ThreadHistograms
+   {
+      std::array<Histogram, static_cast<int>(Phase::Count)> phases;
+   };
+
+public:
+   void Record(Phase phase, uint64_t ns) { local().phases[static_cast<int>(phase)].Record(ns); }
+
+   PhaseStats Stats(Phase phase) {
+      std::array<uint64_t, Histogram::BucketCount> counts = {};
+      uint64_t max = 0;
+      {
+         std::lock_guard lock(mtx);
+         for (auto& thread : threads) { max = std::max(max, thread->phases[static_cast<int>(phase)].Accumulate(counts)); }
+         auto& base = baseline[static_cast<int>(phase)];
+         for (int i = 0; i < Histogram::BucketCount; i++) { counts[i] -= base[i]; }
+      }
+      PhaseStats stats;
+      for (auto count : counts) { stats.count += count; }
+      if (stats.count == 0) return stats;
+      stats.p50 = percentile(counts, stats.count, 0.50) / 1e6;
+      stats.p99 = percentile(counts, stats.count, 0.99) / 1e6;
+      stats.max = max / 1e6;
+      return stats;
+   }
+
+   // Starts a new measurement window
+   void Reset() {
+      std::lock_guard lock(mtx);
+      for (int phase = 0; phase < static_cast<int>(Phase::Count); phase++)
+      {
+         auto& base = baseline[phase];
+         base.fill(0);
+         for (auto& thread : threads)
+         {
+            thread->phases[phase].Accumulate(base);
+            thread->phases[phase].ResetMax();
+         }
+      }
+   }
+
+   void Log(std::ostream& out) {
+      out << "[particulo] phase            count      p50 ms      p99 ms      max ms\n";
+      for (int phase = 0; phase < static_cast<int>(Phase::Count); phase++)
+      {
+         auto stats = Stats(static_cast<Phase>(phase));
+         if (stats.count == 0) continue;
+         char line[128];
+         snprintf(line, sizeof(line), "[particulo] %-16s %8llu %11.3f %11.3f %11.3f\n", PhaseName(static_cast<Phase>(phase)),
+                  static_cast<unsigned long long>(stats.count), stats.p50, stats.p99, stats.max);
+         out << line;
+      }
+      out.flush();
+   }
+
+private:
+   ThreadHistograms& local() {
+      thread_local ThreadHistograms* histograms = nullptr;
+      if (!histograms)
+      {
+         std::lock_guard lock(mtx);
+         threads.push_back(std::make_unique<ThreadHistograms>());
+         histograms = threads.back().get();
+      }
+      return *histograms;
+   }
+   static double percentile(const std::array<uint64_t, Histogram::BucketCount>& counts, uint64_t total, double p) {
+      uint64_t rank = static_cast<uint64_t>(p * (total - 1)) + 1;
+      uint64_t seen = 0;
+      for (int i = 0; i < Histogram::BucketCount; i++)
+      {
+         seen += counts[i];
+         if (seen >= rank) return Histogram::bucketValue(i);
+      }
+      return 0.0;
+   }
+
+private:
+   std::mutex mtx;
+   // Histograms outlive their threads so late readers never see a dangling pointer
+   std::vector<std::unique_ptr<ThreadHistograms>> threads;
+   std::array<std::array<uint64_t, Histogram::BucketCount>, static_cast<int>(Phase::Count)> baseline = {};
+};
+
+inline Profiler& GetProfiler() {
+   static Profiler profiler;
+   return profiler;
+}
+
+class ScopedTimer
+{
+public:
+   explicit ScopedTimer(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+   ScopedTimer(const ScopedTimer&) = delete;
+   ScopedTimer& operator=(const ScopedTimer&) = delete;
+   ~ScopedTimer() {
+      auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+      GetProfiler().Record(phase, static_cast<uint64_t>(elapsed.count()));
+   }
+
+private:
+   Phase phase;
+   std::chrono::steady_clock::time_point start;
+};
+} // namespace Particulo
+
+#ifndef PARTICULO_CONCAT
+#define PARTICULO_CONCAT_INNER(a, b) a##b
+#define PARTICULO_CONCAT(a, b) PARTICULO_CONCAT_INNER(a, b)
+#endif
+
+// Times the enclosing scope; compiles to nothing unless PARTICULO_PROFILE is defined
+#ifdef PARTICULO_PROFILE
+#define PARTICULO_PROFILE_SCOPE(phase) ::Particulo::ScopedTimer PARTICULO_CONCAT(particuloTimer, __LINE__)(phase)
+#else
+#define PARTICULO_PROFILE_SCOPE(phase) ((void) 0)
+#endif
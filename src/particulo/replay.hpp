@@ -0,0 +1,328 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+using std::ofstream;
+using std::string;
+using std::vector;
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Particulo
+{
+// Recorded trajectory layout:
+//   TrajectoryHeader
+//   frame 0 .. frame steps-1   (count * 4 position/size floats, then count * 4 color floats)
+//   TrajectoryFrame index[steps]
+// The float blocks use the same layout as the particle instance buffers, so a frame can be copied straight into them.
+// Everything needed to validate and seek is in the index, so opening a file never touches the frames themselves.
+static constexpr uint32_t TrajectoryMagic = 0x4a525450; // "PTRJ"
+static constexpr uint32_t TrajectoryVersion = 2;
+
+struct TrajectoryHeader
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t maxCount;
+   uint32_t reserved;
+   uint64_t steps;
+   uint64_t indexOffset;
+};
+
+struct TrajectoryFrame
+{
+   // Byte offset of the frame's floats
+   uint64_t offset;
+   uint32_t count;
+   // Seconds since the start of the recording
+   float time;
+};
+
+// Writes a trajectory on a background thread, so recording a step costs a copy rather than a disk write. Frames are
+// written in the order they were submitted; if the disk falls more than MaxBacklog frames behind, Write() waits for it
+// instead of dropping steps.
+class TrajectoryRecorder
+{
+public:
+   static constexpr size_t MaxBacklog = 8;
+
+public:
+   TrajectoryRecorder() = default;
+   TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+   TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+   ~TrajectoryRecorder() { Close(); }
+
+public:
+   void Open(const string& path, uint32_t maxCount) {
+      Close();
+      file.open(path, std::ios::binary | std::ios::trunc);
+      if (!file.is_open()) throw std::runtime_error("Unable to open trajectory file " + path);
+      header = {TrajectoryMagic, TrajectoryVersion, maxCount, 0, 0, 0};
+      index.clear();
+      failed = false;
+      closing = false;
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      worker = std::thread([this] { run(); });
+   }
+   void Write(const float* positions, const float* colors, uint32_t count, float time) {
+      if (!file.is_open()) return;
+      Pending frame;
+      {
+         std::unique_lock lock(mtx);
+         drained.wait(lock, [this] { return queue.size() < MaxBacklog; });
+         // Buffers of written frames are reused, so steady recording doesn't allocate
+         if (!spare.empty())
+         {
+            frame.floats = std::move(spare.back());
+            spare.pop_back();
+         }
+      }
+      frame.floats.resize(static_cast<size_t>(count) * 8);
+      std::memcpy(frame.floats.data(), positions, count * 4 * sizeof(float));
+      std::memcpy(frame.floats.data() + count * 4, colors, count * 4 * sizeof(float));
+      frame.count = count;
+      frame.time = time;
+      {
+         std::lock_guard lock(mtx);
+         queue.push_back(std::move(frame));
+      }
+      wake.notify_one();
+   }
+   // Waits for the queued frames, then writes the index and finalizes the header
+   void Close() {
+      if (!file.is_open()) return;
+      {
+         std::lock_guard lock(mtx);
+         closing = true;
+      }
+      wake.notify_one();
+      worker.join();
+      header.steps = index.size();
+      header.indexOffset = static_cast<uint64_t>(file.tellp());
+      file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(TrajectoryFrame));
+      file.seekp(0);
+      file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      file.close();
+      spare.clear();
+   }
+   bool IsOpen() const { return file.is_open(); }
+   // Whether a write has failed since Open(), e.g. because the disk is full
+   bool Failed() const { return failed; }
+
+private:
+   struct Pending
+   {
+      vector<float> floats;
+      uint32_t count = 0;
+      float time = 0.0f;
+   };
+
+   void run() {
+      while (true)
+      {
+         Pending frame;
+         {
+            std::unique_lock lock(mtx);
+            wake.wait(lock, [this] { return closing || !queue.empty(); });
+            if (queue.empty()) return;
+            frame = std::move(queue.front());
+            queue.pop_front();
+         }
+         drained.notify_one();
+         index.push_back({static_cast<uint64_t>(file.tellp()), frame.count, frame.time});
+         file.write(reinterpret_cast<const char*>(frame.floats.data()), frame.floats.size() * sizeof(float));
+         if (!file) failed = true;
+         std::lock_guard lock(mtx);
+         spare.push_back(std::move(frame.floats));
+      }
+   }
+
+private:
+   ofstream file;
+   TrajectoryHeader header;
+   // Only touched by the writer thread until Close() has joined it
+   vector<TrajectoryFrame> index;
+   std::thread worker;
+   std::mutex mtx;
+   std::condition_variable wake;
+   std::condition_variable drained;
+   std::deque<Pending> queue;
+   vector<vector<float>> spare;
+   bool closing = false;
+   std::atomic<bool> failed = false;
+};
+
+// Read-only view of a recorded trajectory. The file is memory-mapped and frames are read in place; pages of frames that
+// have been consumed are handed back to the OS so resident memory does not grow with the file size.
+class TrajectoryPlayer
+{
+public:
+   TrajectoryPlayer() = default;
+   TrajectoryPlayer(const TrajectoryPlayer&) = delete;
+   TrajectoryPlayer& operator=(const TrajectoryPlayer&) = delete;
+   ~TrajectoryPlayer() { Close(); }
+
+public:
+   // Throws if the file can't be mapped or its header, index or any frame doesn't fit inside it
+   void Open(const string& path) {
+      Close();
+#ifdef _WIN32
+      fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (fileHandle == INVALID_HANDLE_VALUE) throw std::runtime_error("Unable to open trajectory file " + path);
+      LARGE_INTEGER fileSize;
+      if (!GetFileSizeEx(fileHandle, &fileSize)) fail("Unable to open trajectory file " + path);
+      size = static_cast<size_t>(fileSize.QuadPart);
+      if (size < sizeof(TrajectoryHeader)) fail("Truncated trajectory file " + path);
+      mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (!mappingHandle) fail("Unable to map trajectory file " + path);
+      data = static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+      if (!data) fail("Unable to map trajectory file " + path);
+#else
+      fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) throw std::runtime_error("Unable to open trajectory file " + path);
+      struct stat st;
+      if (fstat(fd, &st) != 0) fail("Unable to open trajectory file " + path);
+      size = static_cast<size_t>(st.st_size);
+      // Also keeps an empty file away from mmap, which rejects a zero length
+      if (size < sizeof(TrajectoryHeader)) fail("Truncated trajectory file " + path);
+      void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped == MAP_FAILED) fail("Unable to map trajectory file " + path);
+      data = static_cast<const uint8_t*>(mapped);
+      madvise(mapped, size, MADV_SEQUENTIAL);
+#endif
+      std::memcpy(&header, data, sizeof(header));
+      if (header.magic != TrajectoryMagic) fail("Not a trajectory file: " + path);
+      if (header.version != TrajectoryVersion) fail("Unsupported trajectory file version: " + path);
+      if (header.indexOffset > size || header.steps > (size - header.indexOffset) / sizeof(TrajectoryFrame))
+      { fail("Truncated trajectory file " + path); }
+      // Checks every frame against the file from the index alone, so CopyFrame() can trust it without the frames
+      // being paged in here
+      for (uint64_t step = 0; step < header.steps; step++)
+      {
+         auto frame = GetFrame(step);
+         if (frame.count > header.maxCount) fail("Corrupt trajectory file " + path);
+         if (frame.offset > size || (size - frame.offset) / (8 * sizeof(float)) < frame.count) fail("Truncated trajectory file " + path);
+      }
+      dropPages(header.indexOffset, header.indexOffset + header.steps * sizeof(TrajectoryFrame));
+   }
+   void Close() {
+      if (!data) return;
+#ifdef _WIN32
+      UnmapViewOfFile(data);
+      CloseHandle(mappingHandle);
+      CloseHandle(fileHandle);
+      mappingHandle = NULL;
+      fileHandle = INVALID_HANDLE_VALUE;
+#else
+      munmap(const_cast<uint8_t*>(data), size);
+      close(fd);
+      fd = -1;
+#endif
+      data = nullptr;
+      size = 0;
+      lastReleased = ~0ull;
+   }
+
+public:
+   bool IsOpen() const { return data != nullptr; }
+   uint64_t GetStepCount() const { return header.steps; }
+   uint32_t GetMaxCount() const { return header.maxCount; }
+   TrajectoryFrame GetFrame(uint64_t step) const {
+      TrajectoryFrame frame;
+      std::memcpy(&frame, data + header.indexOffset + step * sizeof(TrajectoryFrame), sizeof(frame));
+      return frame;
+   }
+   const float* GetPositions(uint64_t step) const { return reinterpret_cast<const float*>(data + GetFrame(step).offset); }
+   const float* GetColors(uint64_t step) const { return GetPositions(step) + GetFrame(step).count * 4; }
+
+   // Copies a frame into the instance arrays and returns its particle count
+   uint32_t CopyFrame(uint64_t step, float* positions, float* colors) {
+      auto frame = GetFrame(step);
+      auto floats = reinterpret_cast<const float*>(data + frame.offset);
+      std::memcpy(positions, floats, frame.count * 4 * sizeof(float));
+      std::memcpy(colors, floats + frame.count * 4, frame.count * 4 * sizeof(float));
+      release(step);
+      return frame.count;
+   }
+
+private:
+   // Releases whatever Open() had acquired so far, mapped or not
+   [[noreturn]] void fail(const string& message) {
+      if (data) Close();
+#ifdef _WIN32
+      if (mappingHandle) CloseHandle(mappingHandle);
+      if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+      mappingHandle = NULL;
+      fileHandle = INVALID_HANDLE_VALUE;
+#else
+      if (fd >= 0) close(fd);
+      fd = -1;
+#endif
+      size = 0;
+      header = {};
+      throw std::runtime_error(message);
+   }
+   // Drops the pages of the previously consumed frame from the working set, along with the index pages before the
+   // current entry
+   void release(uint64_t step) {
+      if (lastReleased != step && lastReleased < header.steps)
+      {
+         auto frame = GetFrame(lastReleased);
+         dropPages(frame.offset, frame.offset + frame.count * 8 * sizeof(float));
+         uint64_t entry = header.indexOffset + step * sizeof(TrajectoryFrame);
+         dropPages(header.indexOffset, entry / pageSize() * pageSize());
+      }
+      lastReleased = step;
+   }
+   // The mapping is read-only and file-backed, so dropped pages that are still needed are simply read again
+   void dropPages(uint64_t begin, uint64_t end) {
+#ifndef _WIN32
+      begin = begin / pageSize() * pageSize();
+      end = (end + pageSize() - 1) / pageSize() * pageSize();
+      if (end > begin) madvise(const_cast<uint8_t*>(data) + begin, end - begin, MADV_DONTNEED);
+#endif
+   }
+   static uint64_t pageSize() {
+#ifdef _WIN32
+      return 4096;
+#else
+      static const uint64_t size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+      return size;
+#endif
+   }
+
+private:
+   TrajectoryHeader header = {};
+   const uint8_t* data = nullptr;
+   size_t size = 0;
+   uint64_t lastReleased = ~0ull;
+#ifdef _WIN32
+   HANDLE fileHandle = INVALID_HANDLE_VALUE;
+   HANDLE mappingHandle = NULL;
+#else
+   int fd = -1;
+#endif
+};
+} // namespace Particulo
@@ -1,26 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 using std::ifstream;
 using std::istreambuf_iterator;
+using std::ofstream;
 using std::string;
 
 #include <GLFW/glfw3.h>
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#ifdef PARTICULO_EGL
+#include <EGL/egl.h>
+#endif
 
 namespace Particulo
 {
 struct Shader
 {
    unsigned int ID;
+   // Skips the driver call if the program is already in use on this thread's current context. The cache remembers
+   // which context it was filled on, so making another context current, or the same one current on another thread,
+   // doesn't skip a glUseProgram the new context needs.
    Shader& Use() {
-      glUseProgram(this->ID);
+      auto context = currentContext();
+      if (boundProgram != this->ID || boundContext != context)
+      {
+         glUseProgram(this->ID);
+         boundProgram = this->ID;
+         boundContext = context;
+      }
       return *this;
    }
+   // Location of an active uniform, or -1, which the setters ignore like GL does. Looked up in the table reflected at
+   // link time instead of asking the driver.
+   GLint Location(const char* name) const {
+      for (auto& [uniform, location] : uniforms)
+      {
+         if (uniform == name) return location;
+      }
+      return -1;
+   }
 
    const string ReadFile(const string& filename) {
       ifstream input_file(filename);
@@ -28,7 +58,12 @@ struct Shader
       return string((istreambuf_iterator<char>(input_file)), istreambuf_iterator<char>());
    }
 
+   // Links a program from sources, or loads it from the binary cache if these sources were linked before by the same
+   // driver
    void CompileStrings(const string& vertexShader, const string& fragmentShader) {
+      auto cachePath = binaryCachePath(vertexShader, fragmentShader);
+      if (!cachePath.empty() && loadBinary(cachePath)) return;
+
       // Create the shaders
       GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
       GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
@@ -37,7 +72,6 @@ struct Shader
       int InfoLogLength;
 
       // Compile Vertex Shader
-      printf("Compiling Vertex Shader\n");
       char const* VertexSourcePointer = vertexShader.c_str();
       glShaderSource(VertexShaderID, 1, &VertexSourcePointer, NULL);
       glCompileShader(VertexShaderID);
@@ -53,7 +87,6 @@ struct Shader
       }
 
       // Compile Fragment Shader
-      printf("Compiling Fragment Shader\n");
       char const* FragmentSourcePointer = fragmentShader.c_str();
       glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer, NULL);
       glCompileShader(FragmentShaderID);
@@ -69,10 +102,10 @@ struct Shader
       }
 
       // Link the program
-      printf("Linking program\n");
       GLuint ProgramID = glCreateProgram();
       glAttachShader(ProgramID, VertexShaderID);
       glAttachShader(ProgramID, FragmentShaderID);
+      if (!cachePath.empty()) glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
       glLinkProgram(ProgramID);
 
       // Check the program
@@ -92,6 +125,8 @@ struct Shader
       glDeleteShader(FragmentShaderID);
 
       ID = ProgramID;
+      reflectUniforms();
+      if (Result == GL_TRUE && !cachePath.empty()) saveBinary(cachePath);
    }
 
    void Compile(const char* vertex_file_path, const char* fragment_file_path) {
@@ -197,43 +232,146 @@ struct Shader
       glDeleteShader(FragmentShaderID);
 
       ID = ProgramID;
+      reflectUniforms();
    }
 
+   // Directory of cached program binaries; empty disables the cache. Defaults to $PARTICULO_SHADER_CACHE, or a
+   // "particulo" directory in the user's cache directory.
+   static string& CacheDirectory() {
+      static string directory = defaultCacheDirectory();
+      return directory;
+   }
+   static void SetCacheDirectory(string directory) { CacheDirectory() = std::move(directory); }
+
    void SetFloat(const char* name, float value, bool useShader) {
       if (useShader) this->Use();
-      glUniform1f(glGetUniformLocation(this->ID, name), value);
+      glUniform1f(Location(name), value);
    }
    void SetInteger(const char* name, int value, bool useShader) {
       if (useShader) this->Use();
-      glUniform1i(glGetUniformLocation(this->ID, name), value);
+      glUniform1i(Location(name), value);
    }
    void SetVector2f(const char* name, float x, float y, bool useShader) {
       if (useShader) this->Use();
-      glUniform2f(glGetUniformLocation(this->ID, name), x, y);
+      glUniform2f(Location(name), x, y);
    }
    void SetVector2f(const char* name, const glm::vec2& value, bool useShader) {
       if (useShader) this->Use();
-      glUniform2f(glGetUniformLocation(this->ID, name), value.x, value.y);
+      glUniform2f(Location(name), value.x, value.y);
    }
    void SetVector3f(const char* name, float x, float y, float z, bool useShader) {
       if (useShader) this->Use();
-      glUniform3f(glGetUniformLocation(this->ID, name), x, y, z);
+      glUniform3f(Location(name), x, y, z);
    }
    void SetVector3f(const char* name, const glm::vec3& value, bool useShader) {
       if (useShader) this->Use();
-      glUniform3f(glGetUniformLocation(this->ID, name), value.x, value.y, value.z);
+      glUniform3f(Location(name), value.x, value.y, value.z);
    }
    void SetVector4f(const char* name, float x, float y, float z, float w, bool useShader) {
       if (useShader) this->Use();
-      glUniform4f(glGetUniformLocation(this->ID, name), x, y, z, w);
+      glUniform4f(Location(name), x, y, z, w);
    }
    void SetVector4f(const char* name, const glm::vec4& value, bool useShader) {
       if (useShader) this->Use();
-      glUniform4f(glGetUniformLocation(this->ID, name), value.x, value.y, value.z, value.w);
+      glUniform4f(Location(name), value.x, value.y, value.z, value.w);
    }
    void SetMatrix4(const char* name, const glm::mat4& matrix, bool useShader) {
       if (useShader) this->Use();
-      glUniformMatrix4fv(glGetUniformLocation(this->ID, name), 1, false, glm::value_ptr(matrix));
+      glUniformMatrix4fv(Location(name), 1, false, glm::value_ptr(matrix));
+   }
+
+   void reflectUniforms() {
+      uniforms.clear();
+      GLint count = 0, maxLength = 0;
+      glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+      glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+      std::vector<char> name(std::max(maxLength, 1));
+      for (GLint i = 0; i < count; i++)
+      {
+         GLint size;
+         GLenum type;
+         glGetActiveUniform(ID, i, static_cast<GLsizei>(name.size()), nullptr, &size, &type, name.data());
+         GLint location = glGetUniformLocation(ID, name.data());
+         // Members of uniform blocks have no location
+         if (location < 0) continue;
+         string uniform = name.data();
+         uniforms.emplace_back(uniform, location);
+         // Arrays are reported as "name[0]"; also accept the bare name
+         if (uniform.size() > 3 && uniform.ends_with("[0]")) uniforms.emplace_back(uniform.substr(0, uniform.size() - 3), location);
+      }
+   }
+   static string defaultCacheDirectory() {
+      if (auto directory = getenv("PARTICULO_SHADER_CACHE")) return directory;
+#ifdef _WIN32
+      if (auto directory = getenv("LOCALAPPDATA")) return string(directory) + "\\particulo";
+#else
+      if (auto directory = getenv("XDG_CACHE_HOME")) return string(directory) + "/particulo";
+      if (auto directory = getenv("HOME")) return string(directory) + "/.cache/particulo";
+#endif
+      return "";
+   }
+   // Binaries are only valid for the driver that produced them, so the key covers the driver strings as well as the
+   // sources. Returns an empty path if caching is disabled or unsupported.
+   static string binaryCachePath(const string& vertexShader, const string& fragmentShader) {
+      auto& directory = CacheDirectory();
+      if (directory.empty()) return "";
+      GLint formats = 0;
+      glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+      if (formats == 0) return "";
+      // FNV-1a, with a separator after each string
+      uint64_t hash = 14695981039346656037ull;
+      auto mix = [&hash](const char* text) {
+         for (; text && *text; text++) { hash = (hash ^ static_cast<uint8_t>(*text)) * 1099511628211ull; }
+         hash = (hash ^ 0xff) * 1099511628211ull;
+      };
+      mix(vertexShader.c_str());
+      mix(fragmentShader.c_str());
+      for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) { mix(reinterpret_cast<const char*>(glGetString(name))); }
+      char file[32];
+      snprintf(file, sizeof(file), "%016llx.bin", static_cast<unsigned long long>(hash));
+      return (std::filesystem::path(directory) / file).string();
+   }
+   // Cache files hold the binary format followed by the binary
+   bool loadBinary(const string& path) {
+      ifstream input(path, std::ios::binary);
+      if (!input.is_open()) return false;
+      GLenum format = 0;
+      input.read(reinterpret_cast<char*>(&format), sizeof(format));
+      std::vector<char> binary((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+      if (binary.empty()) return false;
+      GLuint program = glCreateProgram();
+      glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+      GLint linked = GL_FALSE;
+      glGetProgramiv(program, GL_LINK_STATUS, &linked);
+      if (linked != GL_TRUE)
+      {
+         // Rejected, e.g. after a driver update; the caller links from source and overwrites it
+         glDeleteProgram(program);
+         return false;
+      }
+      ID = program;
+      reflectUniforms();
+      return true;
+   }
+   void saveBinary(const string& path) const {
+      GLint length = 0;
+      glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+      if (length <= 0) return;
+      std::vector<char> binary(length);
+      GLenum format = 0;
+      glGetProgramBinary(ID, length, nullptr, &format, binary.data());
+      std::error_code error;
+      std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+      // Written under a unique name and renamed into place, so concurrent launches never read a partial file
+      auto temporary = path + "." + std::to_string(std::random_device{}()) + ".tmp";
+      {
+         ofstream output(temporary, std::ios::binary);
+         output.write(reinterpret_cast<const char*>(&format), sizeof(format));
+         output.write(binary.data(), binary.size());
+         if (!output) error = std::make_error_code(std::errc::io_error);
+      }
+      if (!error) std::filesystem::rename(temporary, path, error);
+      if (error) std::filesystem::remove(temporary, error);
    }
 
    void checkCompileErrors(unsigned int object, std::string type) {
@@ -260,5 +398,39 @@ struct Shader
          }
       }
    }
+
+private:
+   // The offscreen renderer's EGL context, or else the window's
+   static const void* currentContext() {
+#ifdef PARTICULO_EGL
+      if (auto context = eglGetCurrentContext(); context != EGL_NO_CONTEXT) return context;
+#endif
+      return glfwGetCurrentContext();
+   }
+
+private:
+   std::vector<std::pair<string, GLint>> uniforms;
+   static inline thread_local GLuint boundProgram = 0;
+   static inline thread_local const void* boundContext = nullptr;
+};
+
+// A uniform buffer attached to a fixed binding point, shared by every program that declares a block with that binding.
+// `Block` must match the block's std140 layout.
+template <typename Block>
+class UniformBuffer
+{
+public:
+   void Create(GLuint binding) {
+      glGenBuffers(1, &ID);
+      glBindBuffer(GL_UNIFORM_BUFFER, ID);
+      glBufferData(GL_UNIFORM_BUFFER, sizeof(Block), nullptr, GL_DYNAMIC_DRAW);
+      glBindBufferBase(GL_UNIFORM_BUFFER, binding, ID);
+   }
+   void Update(const Block& block) {
+      glBindBuffer(GL_UNIFORM_BUFFER, ID);
+      glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Block), &block);
+   }
+
+   GLuint ID = 0;
 };
 } // namespace Particulo
\ No newline at end of file
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <vector>
+using std::shared_ptr;
+using std::vector;
+
+namespace Particulo
+{
+// Stable reference to a particle. Stays valid while the particle is alive, however the dense array is reordered, and
+// goes stale (instead of pointing at a different particle) once it is removed.
+struct ParticleHandle
+{
+   uint32_t slot = ~0u;
+   uint32_t generation = 0;
+
+   bool operator==(const ParticleHandle&) const = default;
+};
+
+// Generational slot map of particles. Particles are kept densely packed for iteration; a particle's `index` is its
+// slot, which maps to its current dense position. Insertion and removal are O(1): removal swaps the last particle
+// into the hole and patches that particle's slot. Each particle also has a remaining lifetime, stored as a column
+// alongside the dense array; particles that never expire have an infinite lifetime.
+//
+// The dense array is partitioned into awake particles, [0, ActiveCount()), followed by sleeping ones. New particles
+// are awake; removal and Sleep()/Wake() keep the partition with a couple of extra swaps.
+template <typename T>
+class SlotMap
+{
+private:
+   static constexpr uint32_t Free = ~0u;
+   static constexpr uint32_t Reserved = ~0u - 1;
+   static constexpr float Immortal = std::numeric_limits<float>::infinity();
+   struct Slot
+   {
+      uint32_t dense;
+      uint32_t generation;
+   };
+
+public:
+   // Hands out a slot for a particle about to be constructed; it becomes the particle's index
+   uint32_t ReserveSlot() {
+      uint32_t slot;
+      if (!freeSlots.empty())
+      {
+         slot = freeSlots.back();
+         freeSlots.pop_back();
+      }
+      else
+      {
+         slot = static_cast<uint32_t>(slots.size());
+         slots.push_back({Free, 0});
+      }
+      slots[slot].dense = Reserved;
+      return slot;
+   }
+   // Appends a particle constructed with a reserved slot as its index
+   ParticleHandle Insert(shared_ptr<T> particle, float lifetime = Immortal) {
+      auto slot = static_cast<uint32_t>(particle->index);
+      if (slot >= slots.size() || slots[slot].dense != Reserved) throw std::logic_error("Inserted a particle without a reserved slot");
+      slots[slot].dense = static_cast<uint32_t>(dense.size());
+      dense.push_back(std::move(particle));
+      denseSlots.push_back(slot);
+      life.push_back(lifetime);
+      calm.push_back(0);
+      swap(dense.size() - 1, active++);
+      revision++;
+      return {slot, slots[slot].generation};
+   }
+   // Removes the particle at a dense position by moving the last particle into its place. An awake particle is first
+   // swapped with the last awake one, so the hole is always filled from the same partition.
+   void Erase(size_t position) {
+      if (position < active)
+      {
+         swap(position, active - 1);
+         position = --active;
+      }
+      auto slot = denseSlots[position];
+      auto last = dense.size() - 1;
+      if (position != last)
+      {
+         dense[position] = std::move(dense[last]);
+         denseSlots[position] = denseSlots[last];
+         life[position] = life[last];
+         calm[position] = calm[last];
+         slots[denseSlots[position]].dense = static_cast<uint32_t>(position);
+      }
+      dense.pop_back();
+      denseSlots.pop_back();
+      life.pop_back();
+      calm.pop_back();
+      release(slot);
+      revision++;
+   }
+   bool Erase(ParticleHandle handle) {
+      if (!Contains(handle)) return false;
+      Erase(slots[handle.slot].dense);
+      return true;
+   }
+   // Swaps two dense positions; handles are unaffected
+   void SwapPositions(size_t a, size_t b) {
+      swap(a, b);
+      revision++;
+   }
+   // Erases the particles at the given dense positions, each list sorted and the first within the awake partition, the
+   // second within the sleeping one. The survivors that move are only those needed to close the gaps, taken from the
+   // back of their partition, so this costs in proportion to the particles erased rather than to those kept.
+   void Erase(std::span<const uint32_t> awake, std::span<const uint32_t> asleep) {
+      size_t awakeEnd = compact(0, 0, active, awake);
+      size_t end = compact(awakeEnd, active, dense.size(), asleep);
+      for (size_t position = end; position < dense.size(); position++) { release(denseSlots[position]); }
+      dense.resize(end);
+      denseSlots.resize(end);
+      life.resize(end);
+      calm.resize(end);
+      active = awakeEnd;
+      revision++;
+   }
+   // Replaces the whole particle set. Particles must carry slots handed out by this map; slots of particles that are
+   // no longer present are freed. Particles that were already present keep their remaining lifetime.
+   void Assign(vector<shared_ptr<T>>&& particles) {
+      vector<uint32_t> positions(slots.size(), Free);
+      for (size_t i = 0; i < particles.size(); i++)
+      {
+         auto slot = static_cast<uint32_t>(particles[i]->index);
+         if (slot >= slots.size() || slots[slot].dense == Free || positions[slot] != Free)
+         { throw std::logic_error("Assigned a particle without a reserved slot"); }
+         positions[slot] = static_cast<uint32_t>(i);
+      }
+      for (auto slot : denseSlots)
+      {
+         if (positions[slot] == Free) release(slot);
+      }
+      vector<float> newLife(particles.size());
+      denseSlots.resize(particles.size());
+      for (size_t i = 0; i < particles.size(); i++)
+      {
+         auto slot = static_cast<uint32_t>(particles[i]->index);
+         newLife[i] = slots[slot].dense < Reserved ? life[slots[slot].dense] : Immortal;
+         slots[slot].dense = static_cast<uint32_t>(i);
+         denseSlots[i] = slot;
+      }
+      dense = std::move(particles);
+      life = std::move(newLife);
+      calm.assign(dense.size(), 0);
+      active = dense.size();
+      revision++;
+   }
+   void Clear() {
+      for (auto slot : denseSlots) { release(slot); }
+      dense.clear();
+      denseSlots.clear();
+      life.clear();
+      calm.clear();
+      active = 0;
+      revision++;
+   }
+   // Moves a particle to the sleeping partition
+   void Sleep(ParticleHandle handle) {
+      if (!Contains(handle) || slots[handle.slot].dense >= active) return;
+      swap(slots[handle.slot].dense, --active);
+      revision++;
+   }
+   // Moves a particle back to the awake partition
+   void Wake(ParticleHandle handle) {
+      if (!Contains(handle) || slots[handle.slot].dense < active) return;
+      calm[slots[handle.slot].dense] = 0;
+      swap(slots[handle.slot].dense, active++);
+      revision++;
+   }
+   void WakeAll() {
+      std::fill(calm.begin(), calm.end(), 0);
+      active = dense.size();
+      revision++;
+   }
+   size_t ActiveCount() const { return active; }
+   bool SetLifetime(ParticleHandle handle, float lifetime) {
+      if (!Contains(handle)) return false;
+      life[slots[handle.slot].dense] = lifetime;
+      revision++;
+      return true;
+   }
+   // Changes whenever particles are added, removed, reordered or given a new lifetime
+   uint64_t Revision() const { return revision; }
+   // Particles removed so far; handles can only have gone stale if it changed
+   uint64_t RemovedCount() const { return removed; }
+
+public:
+   bool Contains(ParticleHandle handle) const {
+      return handle.slot < slots.size() && slots[handle.slot].generation == handle.generation && slots[handle.slot].dense < Reserved;
+   }
+   shared_ptr<T> Get(ParticleHandle handle) const { return Contains(handle) ? dense[slots[handle.slot].dense] : nullptr; }
+   // Like Get() without touching the reference count, for hot loops
+   T* Find(ParticleHandle handle) const { return Contains(handle) ? dense[slots[handle.slot].dense].get() : nullptr; }
+   ParticleHandle HandleAt(size_t position) const { return {denseSlots[position], slots[denseSlots[position]].generation}; }
+   // An invalid handle if `particle` is no longer in the map, even when its slot has been reused by another particle
+   ParticleHandle HandleOf(const T& particle) const {
+      auto slot = static_cast<uint32_t>(particle.index);
+      if (slot >= slots.size() || slots[slot].dense >= Reserved || dense[slots[slot].dense].get() != &particle) return {};
+      return {slot, slots[slot].generation};
+   }
+   size_t PositionOf(ParticleHandle handle) const { return slots[handle.slot].dense; }
+
+   vector<shared_ptr<T>>& Dense() { return dense; }
+   const vector<shared_ptr<T>>& Dense() const { return dense; }
+   // Remaining lifetimes in seconds, by dense position
+   vector<float>& Lifetimes() { return life; }
+   // Consecutive steps each particle has moved slower than the sleep threshold, by dense position
+   vector<uint16_t>& Calm() { return calm; }
+   size_t size() const { return dense.size(); }
+   void reserve(size_t capacity) {
+      dense.reserve(capacity);
+      denseSlots.reserve(capacity);
+      life.reserve(capacity);
+      calm.reserve(capacity);
+      slots.reserve(capacity);
+      freeSlots.reserve(capacity);
+   }
+   auto begin() { return dense.begin(); }
+   auto end() { return dense.end(); }
+   auto begin() const { return dense.begin(); }
+   auto end() const { return dense.end(); }
+   shared_ptr<T>& operator[](size_t position) { return dense[position]; }
+
+private:
+   void swap(size_t a, size_t b) {
+      if (a == b) return;
+      std::swap(dense[a], dense[b]);
+      std::swap(denseSlots[a], denseSlots[b]);
+      std::swap(life[a], life[b]);
+      std::swap(calm[a], calm[b]);
+      slots[denseSlots[a]].dense = static_cast<uint32_t>(a);
+      slots[denseSlots[b]].dense = static_cast<uint32_t>(b);
+   }
+   // Moves the survivors of [from, end) down to start at `to`, where [to, from) holds only particles being erased, and
+   // returns where they end. Gaps below that end are filled with the last survivors.
+   size_t compact(size_t to, size_t from, size_t end, std::span<const uint32_t> erased) {
+      size_t liveEnd = to + (end - from) - erased.size();
+      auto skip = erased.rbegin();
+      size_t source = end;
+      auto fill = [&](size_t hole) {
+         while (skip != erased.rend() && *skip == source - 1)
+         {
+            ++skip;
+            --source;
+         }
+         swap(hole, --source);
+      };
+      for (size_t hole = to; hole < from && hole < liveEnd; hole++) { fill(hole); }
+      for (auto hole : erased)
+      {
+         if (hole >= liveEnd) break;
+         fill(hole);
+      }
+      return liveEnd;
+   }
+   void release(uint32_t slot) {
+      slots[slot].dense = Free;
+      slots[slot].generation++;
+      freeSlots.push_back(slot);
+      removed++;
+   }
+
+private:
+   vector<shared_ptr<T>> dense;
+   vector<uint32_t> denseSlots;
+   vector<float> life;
+   vector<uint16_t> calm;
+   size_t active = 0;
+   vector<Slot> slots;
+   vector<uint32_t> freeSlots;
+   // Starts past zero so a revision recorded before the first change never matches
+   uint64_t revision = 1;
+   uint64_t removed = 0;
+};
+} // namespace Particulo
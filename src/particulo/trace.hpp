@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Particulo
+{
+// Begin/end timeline events in Chrome Trace Event Format (chrome://tracing, ui.perfetto.dev). Every thread writes to its
+// own fixed-size ring buffer, so recording is lock-free and the oldest events are overwritten once a ring is full.
+class Tracer
+{
+private:
+   struct Event
+   {
+      const char* name;
+      uint64_t start;
+      uint64_t duration;
+   };
+   struct ThreadRing
+   {
+      explicit ThreadRing(int tid, size_t capacity) : tid(tid), events(capacity) {}
+      int tid;
+      std::string name;
+      std::vector<Event> events;
+      std::atomic<uint64_t> written = 0;
+   };
+
+public:
+   static constexpr size_t DefaultCapacity = 1 << 16;
+
+public:
+   // Events are timestamped in nanoseconds relative to the tracer's creation
+   uint64_t Now() const {
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count());
+   }
+   // `name` must outlive the tracer; string literals and PhaseName() are fine
+   void Record(const char* name, uint64_t start, uint64_t end) {
+      auto& ring = local();
+      auto index = ring.written.load(std::memory_order_relaxed);
+      ring.events[index % ring.events.size()] = {name, start, end - start};
+      ring.written.store(index + 1, std::memory_order_release);
+   }
+   void SetThreadName(std::string name) {
+      auto& ring = local();
+      std::lock_guard lock(mtx);
+      ring.name = std::move(name);
+   }
+   // Ring capacity for threads that have not recorded yet
+   void SetCapacity(size_t capacity) { this->capacity = capacity; }
+
+   // Writes every buffered event as a Chrome trace JSON file
+   bool Dump(const std::string& path) {
+      std::ofstream out(path, std::ios::trunc);
+      if (!out.is_open()) return false;
+      std::lock_guard lock(mtx);
+      out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+      bool first = true;
+      for (auto& ring : rings)
+      {
+         if (!ring->name.empty())
+         {
+            out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->tid
+                << ",\"args\":{\"name\":\"" << ring->name << "\"}}";
+            first = false;
+         }
+         auto written = ring->written.load(std::memory_order_acquire);
+         auto size = ring->events.size();
+         for (auto i = written > size ? written - size : 0; i < written; i++)
+         {
+            auto& event = ring->events[i % size];
+            char line[256];
+            snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event.name, ring->tid,
+                     event.start / 1e3, event.duration / 1e3);
+            out << (first ? "" : ",\n") << line;
+            first = false;
+         }
+      }
+      out << "\n]}\n";
+      return true;
+   }
+
+private:
+   ThreadRing& local() {
+      thread_local ThreadRing* ring = nullptr;
+      if (!ring)
+      {
+         std::lock_guard lock(mtx);
+         rings.push_back(std::make_unique<ThreadRing>(static_cast<int>(rings.size()) + 1, capacity));
+         ring = rings.back().get();
+      }
+      return *ring;
+   }
+
+private:
+   std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+   std::mutex mtx;
+   std::vector<std::unique_ptr<ThreadRing>> rings;
+   size_t capacity = DefaultCapacity;
+};
+
+inline Tracer& GetTracer() {
+   static Tracer tracer;
+   return tracer;
+}
+
+class TraceScope
+{
+public:
+   explicit TraceScope(const char* name) : name(name), start(GetTracer().Now()) {}
+   TraceScope(const TraceScope&) = delete;
+   TraceScope& operator=(const TraceScope&) = delete;
+   ~TraceScope() { GetTracer().Record(name, start, GetTracer().Now()); }
+
+private:
+   const char* name;
+   uint64_t start;
+};
+} // namespace Particulo
+
+#ifndef PARTICULO_CONCAT
+#define PARTICULO_CONCAT_INNER(a, b) a##b
+#define PARTICULO_CONCAT(a, b) PARTICULO_CONCAT_INNER(a, b)
+#endif
+
+// Records the enclosing scope as a trace event; compiles to nothing unless PARTICULO_TRACE is defined
+#ifdef PARTICULO_TRACE
+#define PARTICULO_TRACE_SCOPE(name) ::Particulo::TraceScope PARTICULO_CONCAT(particuloTrace, __LINE__)(name)
+#define PARTICULO_TRACE_THREAD(name) ::Particulo::GetTracer().SetThreadName(name)
+#else
+#define PARTICULO_TRACE_SCOPE(name) ((void) 0)
+#define PARTICULO_TRACE_THREAD(name) ((void) 0)
+#endif
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <algorithm>
 #include <chrono>
 #include <cstdint>
@@ -116,7 +118,7 @@ struct v2d
 
    float invLen() { return inv_sqrt(sqrLen()); }
    float sqrLen() { return (x * x + y * y); }
-   float sqrDist(const v2d& b) {
+   float sqrDist(const v2d& b) const {
       v2d a = *this - b;
       return (a.x * a.x + a.y * a.y);
    }